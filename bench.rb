@@ -0,0 +1,358 @@
+#!/usr/bin/env ruby
+
+require 'etc'
+require 'fileutils'
+require 'json'
+require 'open3'
+require 'stringio'
+require 'time'
+require 'tmpdir'
+
+# Benchmarks the emulator and the GIF encoder without Merlin32: the example
+# programs come prebuilt (examples/*.bin), all other workloads are written
+# as machine code right here. Results are printed as JSON, so that runs on
+# different revisions or machines can be compared.
+class Bench
+    ENTRY = 0x6000
+    LOOP = 0x6004 # after the setup code
+    DATA = 0x7000 # target of all data accesses
+    JUMP_TABLE = 0x7100 # pointers for JMP (indirect)
+    SUBROUTINE = 0x6800 # a lone RTS for JSR
+
+    # one instruction per addressing mode, repeated to fill the loop
+    DISPATCH_WORKLOADS = [
+        ['implied', 'INX', [0xe8]],
+        ['accumulator', 'ROL', [0x2a]],
+        ['immediate', 'LDA #$12', [0xa9, 0x12]],
+        ['relative', 'BNE *+2', [0xd0, 0x00]],
+        ['absolute', 'LDA $7000', [0xad, 0x00, 0x70]],
+        ['zero_page', 'LDA $80', [0xa5, 0x80]],
+        ['zero_page_indirect', 'STA ($80)', [0x92, 0x80]],
+        ['indirect', 'JMP ($7100)', nil],
+        ['zero_page_x', 'LDA $80,X', [0xb5, 0x80]],
+        ['zero_page_y', 'LDX $80,Y', [0xb6, 0x80]],
+        ['absolute_x', 'LDA $7000,X', [0xbd, 0x00, 0x70]],
+        ['absolute_y', 'LDA $7000,Y', [0xb9, 0x00, 0x70]],
+        ['indexed_indirect_x', 'LDA ($80,X)', [0xa1, 0x80]],
+        ['indirect_indexed_y', 'LDA ($80),Y', [0xb1, 0x80]],
+    ]
+
+    MIX_WORKLOADS = [
+        # LDA #1, CLC, ADC #3, AND #$7F, EOR $80, ORA #1, SEC, SBC #2, ASL, LSR
+        ['alu', [0xa9, 0x01, 0x18, 0x69, 0x03, 0x29, 0x7f, 0x45, 0x80, 0x09, 0x01,
+                 0x38, 0xe9, 0x02, 0x0a, 0x4a]],
+        # LDA $7000,X, STA $7200,X, INX, LDA ($80),Y, STA $7300,Y, INY
+        ['load_store', [0xbd, 0x00, 0x70, 0x9d, 0x00, 0x72, 0xe8,
+                        0xb1, 0x80, 0x99, 0x00, 0x73, 0xc8]],
+        # CPX #$80, BCC *+2, DEX, BNE *+2, BEQ *+2, BPL *+2
+        ['branch', [0xe0, 0x80, 0x90, 0x00, 0xca, 0xd0, 0x00, 0xf0, 0x00, 0x10, 0x00]],
+        # PHA, PLA, PHP, PLP, PHX, PLX
+        ['stack', [0x48, 0x68, 0x08, 0x28, 0xda, 0xfa]],
+        # JSR SUBROUTINE
+        ['call', [0x20, SUBROUTINE & 0xff, SUBROUTINE >> 8]],
+    ]
+
+    # draws into the hidden hi-res page and shows it, forever
+    ANIMATION = [
+        0xa9, 0x40,       # 6000       LDA #$40
+        0x85, 0xf4,       # 6002       STA $F4     ; page to draw on
+        0xa9, 0x00,       # 6004       LDA #$00
+        0x85, 0xf2,       # 6006       STA $F2
+        0x85, 0xf0,       # 6008       STA $F0     ; frame number
+        0xa5, 0xf0,       # 600A FRAME LDA $F0
+        0x29, 0x1b,       # 600C       AND #$1B
+        0x18,             # 600E       CLC
+        0x65, 0xf4,       # 600F       ADC $F4
+        0x85, 0xf3,       # 6011       STA $F3
+        0xa6, 0xf0,       # 6013       LDX $F0
+        0xa9, 0x04,       # 6015       LDA #$04
+        0x85, 0xf5,       # 6017       STA $F5     ; pages left
+        0xa0, 0x00,       # 6019       LDY #$00
+        0x8a,             # 601B FILL  TXA
+        0x91, 0xf2,       # 601C       STA ($F2),Y
+        0xe8,             # 601E       INX
+        0xc8,             # 601F       INY
+        0xd0, 0xf9,       # 6020       BNE FILL
+        0xe6, 0xf3,       # 6022       INC $F3
+        0xc6, 0xf5,       # 6024       DEC $F5
+        0xd0, 0xf3,       # 6026       BNE FILL
+        0xa5, 0xf4,       # 6028       LDA $F4
+        0xc9, 0x20,       # 602A       CMP #$20
+        0xf0, 0x0b,       # 602C       BEQ SHOW1
+        0xa9, 0x02,       # 602E       LDA #$02
+        0x8d, 0x0b, 0x03, # 6030       STA $030B
+        0xa9, 0x20,       # 6033       LDA #$20
+        0x85, 0xf4,       # 6035       STA $F4
+        0xd0, 0x09,       # 6037       BNE NEXT
+        0xa9, 0x01,       # 6039 SHOW1 LDA #$01
+        0x8d, 0x0b, 0x03, # 603B       STA $030B
+        0xa9, 0x40,       # 603E       LDA #$40
+        0x85, 0xf4,       # 6040       STA $F4
+        0xe6, 0xf0,       # 6042 NEXT  INC $F0
+        0x4c, 0x0a, 0x60, # 6044       JMP FRAME
+    ]
+
+    def initialize
+        @repeat = 3
+        @instructions = 10_000_000
+        @frame_count = 500
+        @plot_count = 50
+        @engines = [['interpreter', ['--no-block-cache']], ['block-cache', []]]
+        args = ARGV.dup
+        use_jit = true
+        while !args.empty?
+            item = args.shift
+            if item == '--repeat'
+                @repeat = args.shift.to_i
+            elsif item == '--instructions'
+                @instructions = args.shift.to_i
+            elsif item == '--frames'
+                @frame_count = args.shift.to_i
+            elsif item == '--plots'
+                @plot_count = args.shift.to_i
+            elsif item == '--no-jit'
+                use_jit = false
+            else
+                STDERR.puts 'Usage: ./bench.rb [options]'
+                STDERR.puts 'Options:'
+                STDERR.puts '  --repeat <n> (default: 3, the fastest run counts)'
+                STDERR.puts '  --instructions <n> (default: 10000000 per workload)'
+                STDERR.puts '  --frames <n> (default: 500)'
+                STDERR.puts '  --plots <n> (default: 50)'
+                STDERR.puts '  --no-jit'
+                exit(1)
+            end
+        end
+        # p65c02 only lists --jit if it has been built with it
+        if use_jit && `./p65c02`.include?('--jit')
+            @engines << ['jit', ['--jit']]
+        end
+        @empty = File.binread('empty')
+    end
+
+    def run
+        results = {
+            'host' => {
+                'system' => `uname -srm`.strip,
+                'processors' => Etc.nprocessors,
+                'compiler' => `gcc -dumpfullversion`.strip,
+                'time' => Time.now.utc.iso8601,
+            },
+            'settings' => {
+                'repeat' => @repeat,
+                'instructions' => @instructions,
+                'frames' => @frame_count,
+                'plots' => @plot_count,
+            },
+        }
+        Dir::mktmpdir do |temp_dir|
+            @temp_dir = temp_dir
+            results['dispatch'] = DISPATCH_WORKLOADS.map do |mode, instruction, code|
+                image = dispatch_image(code)
+                @engines.map do |engine, flags|
+                    result = emulate(mode, image, engine, flags + ['--max-instructions', @instructions.to_s])
+                    result && { 'addressing_mode' => mode, 'instruction' => instruction }.merge(result)
+                end
+            end.flatten.compact
+            results['mixes'] = MIX_WORKLOADS.map do |name, code|
+                image = loop_image(code)
+                @engines.map do |engine, flags|
+                    result = emulate(name, image, engine, flags + ['--max-instructions', @instructions.to_s])
+                    result && { 'mix' => name }.merge(result)
+                end
+            end.flatten.compact
+            programs = Dir['examples/*.bin'].sort.map do |path|
+                [File.basename(path, '.bin'), image_with(File.binread(path).unpack('C*')), []]
+            end
+            programs << ['animation', image_with(ANIMATION), ['--max-frames', @frame_count.to_s]]
+            results['programs'] = programs.map do |name, image, limits|
+                @engines.map do |engine, flags|
+                    result = emulate(name, image, engine, flags + limits)
+                    result && { 'program' => name }.merge(result)
+                end
+            end.flatten.compact
+            results['pgif'] = [encode_frames, encode_plots].flatten
+        end
+        puts JSON.pretty_generate(results)
+    end
+
+    def image_with(code, address = ENTRY)
+        image = @empty.dup
+        image[address, code.size] = code.pack('C*')
+        # pointer at $80 for the indirect addressing modes
+        image[0x80, 2] = [DATA].pack('S<')
+        image[SUBROUTINE] = 0x60.chr # RTS
+        image
+    end
+
+    # LDX #0, LDY #0, then the body repeated until JMP back
+    def loop_image(body, repetitions = 64 / body.size + 1)
+        code = [0xa2, 0x00, 0xa0, 0x00] + body * repetitions
+        code += [0x4c, LOOP & 0xff, LOOP >> 8]
+        image_with(code)
+    end
+
+    def dispatch_image(code)
+        return loop_image(code, 64) if code
+        # a ring of JMP (indirect), every one with its own pointer
+        count = 64
+        code = [0xa2, 0x00, 0xa0, 0x00]
+        count.times do |i|
+            pointer = JUMP_TABLE + i * 2
+            code += [0x6c, pointer & 0xff, pointer >> 8]
+        end
+        image = image_with(code)
+        count.times do |i|
+            image[JUMP_TABLE + i * 2, 2] = [LOOP + ((i + 1) % count) * 3].pack('S<')
+        end
+        image
+    end
+
+    # runs p65c02 --bench, the fastest of all runs counts, runs ending in
+    # an error (like example05) get skipped
+    def emulate(name, image, engine, flags)
+        STDERR.puts "#{name} (#{engine})"
+        path = File.join(@temp_dir, 'disk_image')
+        File.binwrite(path, image)
+        best = nil
+        @repeat.times do
+            stdout, stderr, status = Open3.capture3('./p65c02', '--bench', *flags, path, :stdin_data => '')
+            unless status.success?
+                STDERR.puts stderr
+                STDERR.puts "Skipping #{name} (#{engine})."
+                return nil
+            end
+            report = JSON.parse(stdout)
+            best = report if best.nil? || report['host_seconds'] < best['host_seconds']
+        end
+        {
+            'engine' => engine,
+            'stop' => best['stop'],
+            'instructions' => best['instructions'],
+            'cycles' => best['cycles'],
+            'host_seconds' => best['host_seconds'],
+            'ns_per_instruction' => best['ns_per_instruction'],
+            'mips' => (best['instructions_per_second'] / 1e6).round(3),
+            'emulated_mhz' => best['emulated_mhz'],
+        }
+    end
+
+    # times pgif for every thread count, the fastest of all runs counts
+    def encode(workload, input_path, frame_count, pixel_count, args)
+        [1, Etc.nprocessors].uniq.map do |threads|
+            STDERR.puts "pgif #{workload} (#{threads} threads)"
+            output_path = File.join(@temp_dir, 'output.gif')
+            best = nil
+            @repeat.times do
+                t0 = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+                system('./pgif', '-j', threads.to_s, *args, :in => input_path, :out => output_path)
+                t1 = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+                unless $?.success?
+                    STDERR.puts "pgif failed on #{workload}"
+                    exit(1)
+                end
+                best = t1 - t0 if best.nil? || t1 - t0 < best
+            end
+            {
+                'workload' => workload,
+                'threads' => threads,
+                'frames' => frame_count,
+                'seconds' => best.round(6),
+                'frames_per_second' => (frame_count / best).round(1),
+                'megapixels_per_second' => (pixel_count / best / 1e6).round(3),
+                'input_bytes' => File.size(input_path),
+                'gif_bytes' => File.size(output_path),
+            }
+        end
+    end
+
+    # records the animation with p65c02 --frames and feeds it to pgif
+    def encode_frames
+        image_path = File.join(@temp_dir, 'disk_image')
+        frames_path = File.join(@temp_dir, 'frames')
+        File.binwrite(image_path, image_with(ANIMATION))
+        system('./p65c02', '--hide-log', '--no-screen', '--output', '/dev/null',
+               '--frames', frames_path, '--max-frames', @frame_count.to_s, image_path,
+               :in => '/dev/null', :err => '/dev/null')
+        unless $?.success?
+            STDERR.puts 'Recording frames failed.'
+            exit(1)
+        end
+        frame_count = count_frames(File.binread(frames_path))
+        encode('frames', frames_path, frame_count, frame_count * 280 * 192, ['280', '192', '2'])
+    end
+
+    # number of 'h' commands in a --frames stream, see emit_frame() in p65c02.c
+    def count_frames(data)
+        offset = "000000\nffffff\n".size
+        count = 0
+        while offset < data.size
+            command = data[offset, 2]
+            if command == "c\n"
+                offset += 2 + 192 / 8 + 40 * 192 / 8
+            elsif command == "h\n"
+                offset += 2 + 40 * 192
+                count += 1
+            else
+                offset = data.index("\n", offset) + 1 # d <delay>
+            end
+        end
+        count
+    end
+
+    # plots like the ones champ.rb draws for watches, see write_report
+    def encode_plots
+        width = 200 + 30 + 10 + 32
+        height = 200 + 10 + 32 + 50
+        colors_used = 32 * 3
+        io = StringIO.new
+        io.binmode
+        colors_used.times do |i|
+            io.puts sprintf('%02x%02x%02x', (i * 37) & 0xff, (i * 73) & 0xff, (i * 151) & 0xff)
+        end
+        random = Random.new(1)
+        @plot_count.times do
+            pixels = [0] * width * height
+            # grid lines
+            (0..4).each do |i|
+                (0..199).each do |j|
+                    pixels[(42 + i * 50) * width + 30 + j] |= 0x20
+                    pixels[(42 + j) * width + 30 + i * 50] |= 0x20
+                end
+            end
+            # a noisy random walk, brighter where points overlap
+            y = random.rand(200)
+            2000.times do |i|
+                y = (y + random.rand(-6..6)).clamp(0, 199)
+                x = i * 200 / 2000
+                offset = (42 + y) * width + 30 + x
+                pixels[offset] = [(pixels[offset] & 0x1f) + 4, 31].min
+            end
+            # histogram bars along the top
+            (0..199).each do |x|
+                value = random.rand(32)
+                (0...value).each do |dy|
+                    pixels[(38 - dy) * width + 30 + x] = value - dy + 0x40
+                end
+            end
+            io.puts 'p'
+            io.write([8, pixels.size].pack('CL<'))
+            io.write(pixels.pack('C*'))
+        end
+        plots_path = File.join(@temp_dir, 'plots')
+        File.binwrite(plots_path, io.string)
+        encode('watch_plots', plots_path, @plot_count, @plot_count * width * height,
+               [width.to_s, height.to_s, colors_used.to_s])
+    end
+end
+
+['p65c02', 'pgif'].each do |file|
+    unless FileUtils.uptodate?(file, ["#{file}.c", 'gif.c', 'gif.h'])
+        system("gcc -O2 -pthread -o #{file} #{file}.c gif.c")
+        unless $?.exitstatus == 0
+            exit(1)
+        end
+    end
+end
+
+Bench.new.run
@@ -1,8 +1,10 @@
 #!/usr/bin/env ruby
 
+require 'cgi'
 require 'fileutils'
 require 'open3'
 require 'set'
+require 'shellwords'
 require 'tmpdir'
 require 'yaml'
 require 'stringio'
@@ -43,6 +45,27 @@ EOS
 FONT = FONT_DATA.split(/\s+/).map { |x| x.strip }.reject { |x| x.empty? }.map { |x| x.to_i(16) }
 
 class Champ
+    # binary event protocol spoken by p65c02, see emit_stream_header() in p65c02.c
+    EVENT_PROTOCOL_VERSION = 7
+    EVENT_ERROR = 1
+    EVENT_LOG = 2
+    EVENT_CALL = 3
+    EVENT_WATCH = 4
+    EVENT_SCREEN = 5
+    EVENT_CYCLES = 6
+    EVENT_FUNCTION = 7
+    EVENT_CALL_EDGE = 8
+    EVENT_FRAME_STATS = 9
+    EVENT_WRITE_WATCH = 10
+    EVENT_HEAT_MAP = 11
+    EVENT_PC_CYCLES = 12
+    FRAME_HISTOGRAM_BINS = 32
+    MAX_WRITE_WATCH_ROWS = 100
+    HOTTEST_ADDRESSES = 32
+    PAGE_CROSSING_ROWS = 32
+    # reads, writes, fetches
+    HEAT_MAP_COLORS = ['#3465a4', '#cc0000', '#4e9a06']
+
     def initialize
         if ARGV.empty?
             STDERR.puts 'Usage: ./champ.rb [options] <config.yaml>'
@@ -50,6 +73,9 @@ class Champ
             STDERR.puts '  --max-frames <n>'
             STDERR.puts '  --error-log-size <n> (default: 20)'
             STDERR.puts '  --no-animation'
+            STDERR.puts '  --jit'
+            STDERR.puts '  --heat-map (count accesses per address, slower)'
+            STDERR.puts '  --page-crossings (cycles lost to page crossings per instruction, slower)'
             exit(1)
         end
         @have_dot = `dot -V 2>&1`.strip[0, 3] == 'dot'
@@ -58,6 +84,11 @@ class Champ
         FileUtils.mkpath(@files_dir)
         @max_frames = nil
         @record_frames = true
+        @use_jit = false
+        @record_heat_map = false
+        @heat_map = nil
+        @record_page_crossings = false
+        @pc_cycles = nil
         @cycles_per_function = {}
         @execution_log = []
         @execution_log_size = 20
@@ -74,6 +105,12 @@ class Champ
                 @execution_log_size = args.shift.to_i
             elsif item == '--no-animation'
                 @record_frames = false
+            elsif item == '--jit'
+                @use_jit = true
+            elsif item == '--heat-map'
+                @record_heat_map = true
+            elsif item == '--page-crossings'
+                @record_page_crossings = true
             else
                 STDERR.puts "Invalid argument: #{item}"
                 exit(1)
@@ -102,6 +139,7 @@ class Champ
         @global_variables = {}
         @watches = {}
         @watches_for_index = []
+        @write_watches = []
         @label_for_pc = {}
         @pc_for_label = {}
 
@@ -156,6 +194,23 @@ class Champ
                     @disk_image[@pc_for_label[label]] = 0x60 # insert RTS
                 end
             end
+            # an address, a label or a [first, last] range
+            (@config['write_watches'] || []).each do |entry|
+                first, last = entry.is_a?(Array) ? entry : [entry, nil]
+                variable = @global_variables[first]
+                first = variable ? variable[:address] : (@pc_for_label[first] || first)
+                if last.nil?
+                    last = first
+                    last += 1 if variable && ['u16', 's16'].include?(variable[:type])
+                else
+                    last = @pc_for_label[last] || last
+                end
+                @write_watches << {
+                    :name => entry.is_a?(String) ? entry : nil,
+                    :first => first,
+                    :last => last
+                }
+            end
             File.binwrite(File.join(temp_dir, 'disk_image'), @disk_image.pack('C*'))
             # build watch input for C program
             io = StringIO.new
@@ -184,132 +239,142 @@ class Champ
             @watch_values = {}
             @watch_called_from_subroutine = {}
             start_pc = @pc_for_label[@config['entry']] || @config['entry']
-            Signal.trap('INT') do
-                puts 'Killing 65C02 profiler...'
-                throw :sigint
-            end
             @frame_count = 0
             cycle_count = 0
-            last_frame_time = 0
-            frame_cycles = []
+            @redrawn_bytes = 0
+            @frame_stats = nil
             @total_cycles_per_function = {}
+            @inclusive_cycles_per_function = {}
             @calls_per_function = {}
             @call_graph_counts = {}
             @max_cycle_count = 0
-            call_stack = []
-            last_call_stack_cycles = 0
-            Open3.popen2("./p65c02 #{@record_frames ? '' : '--no-screen'} --start-pc #{start_pc} #{File.join(temp_dir, 'disk_image')}") do |stdin, stdout, thread|
+            call_events = @cycles_per_function.keys.map { |pc| sprintf('--call-events 0x%04x', pc) }.join(' ')
+            # p65c02 encodes the animation itself
+            gif = @record_frames ? "--gif #{File.join(@files_dir, 'frames.gif')}" : ''
+            max_frames = @max_frames ? "--max-frames #{@max_frames}" : ''
+            # frames start at every screen unless there's a frame_start
+            start_frame = ''
+            if @config['frame_start']
+                start_frame = "--start-frame #{@pc_for_label[@config['frame_start']] || @config['frame_start']}"
+            end
+            write_watches = @write_watches.map { |watch| sprintf('--write-watch 0x%04x 0x%04x', watch[:first], watch[:last]) }.join(' ')
+            @write_watch_hits = @write_watches.map { [] }
+            # keyboard and stubbed I/O addresses instead of instant_rts
+            io_options = ''
+            if @config['soft_switches'] || @config['keys']
+                io_options += ' --soft-switches'
+            end
+            if @config['keys']
+                io_options += " --keys #{Shellwords.escape(@config['keys'])}"
+            end
+            (@config['io_values'] || {}).each_pair do |address, value|
+                io_options += " --io-value #{@pc_for_label[address] || address} #{value}"
+            end
+            Open3.popen2("./p65c02 --no-screen #{gif} #{max_frames} #{start_frame}#{io_options} #{@use_jit ? '--jit' : ''} #{@record_heat_map ? '--heat-map' : ''} #{@record_page_crossings ? '--page-crossings' : ''} #{call_events} #{write_watches} --log-size #{@execution_log_size} --start-pc #{start_pc} #{File.join(temp_dir, 'disk_image')}", :pgroup => true) do |stdin, stdout, thread|
                 stdin.puts watch_input.split("\n").size
                 stdin.puts watch_input
                 stdin.close
-                catch :sigint do
-                    gi = nil
-                    go = nil
-                    gt = nil
-                    if @record_frames
-                        gi, go, gt = Open3.popen2("./pgif 280 192 2 > #{File.join(@files_dir, 'frames.gif')}")
-                        gi.puts '000000'
-                        gi.puts 'ffffff'
+                # p65c02 stops on SIGINT and still writes its profile, so
+                # keep reading until the end of the stream
+                stopping = false
+                Signal.trap('INT') do
+                    unless stopping
+                        puts
+                        puts 'Stopping 65C02 profiler...'
+                        stopping = true
+                        Process.kill('INT', thread.pid) rescue nil
                     end
-                    stdout.each_line do |line|
-#                         puts "> #{line}"
-                        parts = line.split(' ')
-                        if parts.first == 'error'
-                            parts.shift
-                            pc = parts.shift.to_i(16)
-                            message = parts.join(' ')
-                            @error = {:pc => pc, :message => message}
-                        elsif parts.first == 'log'
-                            parts.shift
-                            log = parts.map { |x| x.to_i(16) }
-                            @execution_log << log
-                            while @execution_log.size > @execution_log_size
-                                @execution_log.shift
-                            end
-                        elsif parts.first == 'jsr'
-                            pc = parts[1].to_i(16)
-                            cycles = parts[2].to_i
-                            @max_cycle_count = cycles
-                            @calls_per_function[pc] ||= 0
-                            @calls_per_function[pc] += 1
-                            calling_function = start_pc
-                            unless call_stack.empty?
-                                calling_function = call_stack.last
-                                @total_cycles_per_function[call_stack.last] ||= 0
-                                @total_cycles_per_function[call_stack.last] += cycles - last_call_stack_cycles
-                            end
-                            @call_graph_counts[calling_function] ||= {}
-                            @call_graph_counts[calling_function][pc] ||= 0
-                            @call_graph_counts[calling_function][pc] += 1
-                            last_call_stack_cycles = cycles
-                            call_stack << pc
-                        elsif parts.first == 'rts'
-                            cycles = parts[1].to_i
-                            @max_cycle_count = cycles
-                            last_cycles = @total_cycles_per_function[call_stack.last] || 0
-                            unless call_stack.empty?
-                                @total_cycles_per_function[call_stack.last] ||= 0
-                                @total_cycles_per_function[call_stack.last] += cycles - last_call_stack_cycles
-                            end
-                            if @cycles_per_function.include?(call_stack.last)
-                                @cycles_per_function[call_stack.last] << {
-                                    :call_cycles => @total_cycles_per_function[call_stack.last] - last_cycles,
-                                    :at_cycles => cycles
-                                }
-                            end
-                            last_call_stack_cycles = cycles
-                            call_stack.pop
-                        elsif parts.first == 'watch'
-                            watch_index = parts[2].to_i
-                            cycles = parts[3].to_i
-                            @max_cycle_count = cycles
-                            @watch_called_from_subroutine[watch_index] ||= Set.new()
-                            @watch_called_from_subroutine[watch_index] << parts[1].to_i(16)
-                            @watch_values[watch_index] ||= []
-                            watch_value_tuple = parts[4, parts.size - 4].map { |x| x.to_i }
-                            @watch_values[watch_index] << {:tuple => watch_value_tuple, :cycles => cycles}
-                        elsif parts.first == 'screen'
-                            @frame_count += 1
-                            print "\rFrames: #{@frame_count}, Cycles: #{cycle_count}"
-                            this_frame_cycles = parts[1].to_i
-                            @max_cycle_count = this_frame_cycles
-                            frame_cycles << this_frame_cycles
-                            if @record_frames
-                                data = parts[2, parts.size - 2].map { |x| x.to_i }
-                                gi.puts 'l'
-                                (0...192).each do |y|
-                                    (0...280).each do |x|
-                                        b = (data[y * 40 + (x / 7)] >> (x % 7)) & 1
-                                        gi.print b
-                                    end
-                                    gi.puts
-                                end
-
-                                gi.puts "d #{(this_frame_cycles - last_frame_time) / 10000}"
-                            end
-                            last_frame_time = this_frame_cycles
-
-                            if @max_frames && @frame_count >= @max_frames
-                                break
-                            end
-                        elsif parts.first == 'cycles'
-                            cycle_count = parts[1].to_i
-                            @max_cycle_count = cycle_count
-                            print "\rFrames: #{@frame_count}, Cycles: #{cycle_count}"
+                end
+                stdout.binmode
+                magic, version = (stdout.read(5) || '').unpack('a4C')
+                unless magic == 'CHMP' && version == EVENT_PROTOCOL_VERSION
+                    STDERR.puts 'Unexpected output from 65C02 profiler.'
+                    exit(1)
+                end
+                loop do
+                    header = stdout.read(3)
+                    break if header.nil? || header.size < 3
+                    type, length = header.unpack('CS<')
+                    payload = length > 0 ? stdout.read(length) : ''
+                    break if payload.nil? || payload.size < length
+                    if type == EVENT_ERROR
+                        pc = payload.unpack1('S<')
+                        message = payload[2, payload.size - 2]
+                        @error = {:pc => pc, :message => message}
+                    elsif type == EVENT_LOG
+                        log = payload.unpack('S<CCCS<CC')
+                        @execution_log << log
+                        while @execution_log.size > @execution_log_size
+                            @execution_log.shift
                         end
-                    end
-                    if @record_frames
-                        gi.close
-                        gt.join
+                    elsif type == EVENT_CALL
+                        pc, cycles, call_cycles = payload.unpack('S<Q<Q<')
+                        @max_cycle_count = cycles
+                        if @cycles_per_function.include?(pc)
+                            @cycles_per_function[pc] << {
+                                :call_cycles => call_cycles,
+                                :at_cycles => cycles
+                            }
+                        end
+                    elsif type == EVENT_FUNCTION
+                        pc, calls, exclusive_cycles, inclusive_cycles = payload.unpack('S<Q<Q<Q<')
+                        @calls_per_function[pc] = calls
+                        @total_cycles_per_function[pc] = exclusive_cycles
+                        @inclusive_cycles_per_function[pc] = inclusive_cycles
+                    elsif type == EVENT_CALL_EDGE
+                        caller, callee, count = payload.unpack('S<S<Q<')
+                        @call_graph_counts[caller] ||= {}
+                        @call_graph_counts[caller][callee] = count
+                    elsif type == EVENT_WATCH
+                        subroutine, watch_index, cycles, value_count, *values = payload.unpack('S<L<Q<Cl<l<')
+                        @max_cycle_count = cycles
+                        @watch_called_from_subroutine[watch_index] ||= Set.new()
+                        @watch_called_from_subroutine[watch_index] << subroutine
+                        @watch_values[watch_index] ||= []
+                        watch_value_tuple = values[0, value_count]
+                        @watch_values[watch_index] << {:tuple => watch_value_tuple, :cycles => cycles}
+                    elsif type == EVENT_WRITE_WATCH
+                        address, value, pc, cycles = payload.unpack('S<CS<Q<')
+                        @max_cycle_count = cycles
+                        @write_watches.each.with_index do |watch, index|
+                            next unless address >= watch[:first] && address <= watch[:last]
+                            @write_watch_hits[index] << {:address => address, :value => value, :pc => pc, :cycles => cycles}
+                        end
+                    elsif type == EVENT_HEAT_MAP
+                        kind, page, *counts = payload.unpack('CCQ<256')
+                        @heat_map ||= [0, 1, 2].map { [0] * 0x10000 }
+                        @heat_map[kind][page * 0x100, 0x100] = counts
+                    elsif type == EVENT_PC_CYCLES
+                        pc, count, base, page_crossing, branch_taken, branch_page_crossing = payload.unpack('S<Q<Q<Q<Q<Q<')
+                        @pc_cycles ||= {}
+                        @pc_cycles[pc] = {
+                            :count => count,
+                            :base => base,
+                            :page_crossing => page_crossing,
+                            :branch_taken => branch_taken,
+                            :branch_page_crossing => branch_page_crossing
+                        }
+                    elsif type == EVENT_SCREEN
+                        @frame_count += 1
+                        print "\rFrames: #{@frame_count}, Cycles: #{cycle_count}"
+                        this_frame_cycles, redrawn = payload.unpack('Q<S<')
+                        @max_cycle_count = this_frame_cycles
+                        @redrawn_bytes += redrawn
+                    elsif type == EVENT_CYCLES
+                        cycle_count = payload.unpack1('Q<')
+                        @max_cycle_count = cycle_count
+                        print "\rFrames: #{@frame_count}, Cycles: #{cycle_count}"
+                    elsif type == EVENT_FRAME_STATS
+                        values = payload.unpack("CL<Q<7L<#{FRAME_HISTOGRAM_BINS}")
+                        @frame_stats = {}
+                        [:mode, :count, :min, :max, :mean, :p50, :p95, :p99, :bin_width].each.with_index do |key, i|
+                            @frame_stats[key] = values[i]
+                        end
+                        @frame_stats[:histogram] = values[9, FRAME_HISTOGRAM_BINS]
                     end
                 end
             end
             puts
-            
-            @cycles_per_frame = []
-            (2...frame_cycles.size).each do |i|
-                @cycles_per_frame << frame_cycles[i] - frame_cycles[i - 1]
-            end
         end
     end
 
@@ -351,6 +416,46 @@ class Champ
         end
     end
 
+    # renders reads, writes and fetches next to each other, one line per page
+    def write_heat_map
+        gap = 8
+        top = 12
+        width = 256 * 3 + gap * 2
+        height = 256 + top
+        pixels = [0] * (width * height)
+        palette = ['ffffff']
+        HEAT_MAP_COLORS.each.with_index do |color, kind|
+            r, g, b = [1, 3, 5].map { |i| color[i, 2].to_i(16) }
+            (1..31).each do |level|
+                # single accesses should still be visible
+                fade = 0.25 + 0.75 * level.to_f / 31
+                palette << [r, g, b].map { |x| sprintf('%02x', (x * fade + 0xff * (1.0 - fade)).to_i) }.join
+            end
+            counts = @heat_map[kind]
+            scale = Math.log([counts.max, 2].max)
+            left = kind * (256 + gap)
+            (0...0x10000).each do |address|
+                next if counts[address] == 0
+                level = 1 + (30 * Math.log(counts[address]) / scale).round
+                pixels[(top + (address >> 8)) * width + left + (address & 0xff)] = kind * 31 + level
+            end
+            print_s(pixels, width, height, left, 2, ['reads', 'writes', 'fetches'][kind], kind * 31 + 31)
+        end
+        gi, go, gt = Open3.popen2("./pgif #{width} #{height} #{palette.size}")
+        gi.binmode
+        gi.puts palette.join("\n")
+        gi.puts 'p'
+        gi.write([8, pixels.size].pack('CL<'))
+        gi.write(pixels.pack('C*'))
+        gi.close
+        path = File.join(@files_dir, 'heat_map.gif')
+        File::open(path, 'w') do |f|
+            f.write go.read
+        end
+        gt.join
+        path
+    end
+
     def write_report
         html_name = 'report.html'
         print "Writing report to file://#{File.absolute_path(html_name)} ..."
@@ -362,14 +467,112 @@ class Champ
             if @record_frames
                 io.puts "<img class='screenshot' src='#{File.join(@files_dir, 'frames.gif')}' /><br />"
             end
-            if @cycles_per_frame.size > 0
+            if @frame_stats
+                stats = @frame_stats
                 io.puts '<p>'
                 io.puts "Frames recorded: #{@frame_count}<br />"
-                io.puts "Average cycles/frame: #{@cycles_per_frame.inject(0) { |sum, x| sum + x } / @cycles_per_frame.size}<br />"
-                io.puts '<p>'
+                if stats[:mode] == 1
+                    io.puts "Frames timed from #{@config['frame_start']}: #{stats[:count]}<br />"
+                end
+                io.puts "Cycles/frame: min #{stats[:min]}, mean #{stats[:mean]}, max #{stats[:max]}<br />"
+                io.puts "Percentiles: p50 #{stats[:p50]}, p95 #{stats[:p95]}, p99 #{stats[:p99]}<br />"
+                if @record_frames && @frame_count > 0
+                    # p65c02 only tracks screen writes while recording
+                    io.puts "Average bytes redrawn/frame: #{@redrawn_bytes / @frame_count}<br />"
+                end
+                io.puts '</p>'
+                # histogram, one row per non-empty bin
+                max_bin = stats[:histogram].max
+                io.puts '<table>'
+                io.puts '<tr><th>Cycles</th><th>Frames</th><th></th></tr>'
+                stats[:histogram].each.with_index do |count, i|
+                    next if count == 0
+                    from = stats[:min] + i * stats[:bin_width]
+                    io.puts '<tr>'
+                    io.puts "<td style='text-align: right;'>#{from}#{stats[:bin_width] > 1 ? " - #{from + stats[:bin_width] - 1}" : ''}</td>"
+                    io.puts "<td style='text-align: right;'>#{count}</td>"
+                    io.puts "<td><div style='background-color: #babdb6; height: 0.8em; width: #{(count * 200 / max_bin).clamp(1, 200)}px;'></div></td>"
+                    io.puts '</tr>'
+                end
+                io.puts '</table>'
             end
             report.sub!('#{screenshots}', io.string)
 
+            # write heat map
+            io = StringIO.new
+            if @heat_map
+                io.puts '<h2>Memory</h2>'
+                io.puts "<img src='#{write_heat_map}' /><br />"
+                io.puts '<p>One line per page, brighter colors mean more accesses (log scale).</p>'
+                io.puts '<table>'
+                io.puts '<tr><th>Addr</th><th>Reads</th><th>Writes</th><th>Fetches</th><th>Label</th></tr>'
+                label_for_address = {}
+                @global_variables.each_pair do |label, item|
+                    label_for_address[item[:address]] = label
+                    if ['u16', 's16'].include?(item[:type])
+                        label_for_address[item[:address] + 1] = "#{label}+1"
+                    end
+                end
+                (0...0x10000).select do |address|
+                    @heat_map[0][address] + @heat_map[1][address] > 0
+                end.sort_by do |address|
+                    -(@heat_map[0][address] + @heat_map[1][address])
+                end.first(HOTTEST_ADDRESSES).each do |address|
+                    io.puts '<tr>'
+                    io.puts "<td>#{sprintf('0x%04x', address)}</td>"
+                    (0...3).each do |kind|
+                        io.puts "<td style='text-align: right;'>#{@heat_map[kind][address]}</td>"
+                    end
+                    io.puts "<td>#{label_for_address[address] || @label_for_pc[address]}</td>"
+                    io.puts '</tr>'
+                end
+                io.puts '</table>'
+                # pages nobody touched, free to reuse
+                unused = (0...0x100).select do |page|
+                    (0...3).all? { |kind| @heat_map[kind][page * 0x100, 0x100].all? { |count| count == 0 } }
+                end
+                ranges = unused.slice_when { |a, b| b != a + 1 }.map do |pages|
+                    sprintf('0x%04x - 0x%04x', pages.first * 0x100, pages.last * 0x100 + 0xff)
+                end
+                io.puts "<p>Untouched pages: #{ranges.empty? ? 'none' : ranges.join(', ')}</p>"
+            end
+            report.sub!('#{heat_map}', io.string)
+
+            # write the instructions which lose the most cycles to page crossings
+            io = StringIO.new
+            if @pc_cycles
+                io.puts '<h2>Page crossings</h2>'
+                totals = Hash.new(0)
+                @pc_cycles.each_value do |entry|
+                    entry.each_pair { |key, value| totals[key] += value }
+                end
+                all_cycles = totals[:base] + totals[:page_crossing] + totals[:branch_taken] + totals[:branch_page_crossing]
+                lost = totals[:page_crossing] + totals[:branch_page_crossing]
+                io.puts "<p>#{lost} of #{all_cycles} cycles (#{sprintf('%1.2f', lost * 100.0 / [all_cycles, 1].max)}%) went to page crossings: "
+                io.puts "#{totals[:page_crossing]} for indexed addressing and #{totals[:branch_page_crossing]} for branches to another page. "
+                io.puts "Taken branches cost another #{totals[:branch_taken]} cycles.</p>"
+                rows = @pc_cycles.select do |pc, entry|
+                    entry[:page_crossing] + entry[:branch_page_crossing] > 0
+                end.sort_by do |pc, entry|
+                    -(entry[:page_crossing] + entry[:branch_page_crossing])
+                end.first(PAGE_CROSSING_ROWS)
+                unless rows.empty?
+                    io.puts '<table>'
+                    io.puts '<tr><th>PC</th><th>Executed</th><th>Base</th><th>Page crossing</th><th>Branch taken</th><th>Branch page crossing</th><th>Source</th></tr>'
+                    rows.each do |pc, entry|
+                        io.puts '<tr>'
+                        io.puts "<td>#{sprintf('0x%04x', pc)}</td>"
+                        [:count, :base, :page_crossing, :branch_taken, :branch_page_crossing].each do |key|
+                            io.puts "<td style='text-align: right;'>#{entry[key]}</td>"
+                        end
+                        io.puts "<td>#{source_line_for_pc(pc)}</td>"
+                        io.puts '</tr>'
+                    end
+                    io.puts '</table>'
+                end
+            end
+            report.sub!('#{page_crossings}', io.string)
+
             # write watches
             io = StringIO.new
             @watches_for_index.each.with_index do |watch, index|
@@ -678,9 +881,11 @@ class Champ
                             xb = (hb * fade + 0xff * (1.0 - fade)).to_i
                             palette[i + 64] = sprintf('%02x%02x%02x', xr, xg, xb)
                         end
+                        gi.binmode
                         gi.puts palette.join("\n")
-                        gi.puts 'f'
-                        gi.puts pixels.map { |x| sprintf('%02x', x) }.join("\n")
+                        gi.puts 'p'
+                        gi.write([8, pixels.size].pack('CL<'))
+                        gi.write(pixels.pack('C*'))
                         gi.close
                         gt.join
                         watch_path = File.join(@files_dir, "watch_#{index}.gif")
@@ -695,6 +900,44 @@ class Champ
                 io.puts "</div>"
             end
             report.sub!('#{watches}', io.string)
+
+            # write write watches, who wrote which value and when
+            io = StringIO.new
+            @write_watches.each.with_index do |watch, index|
+                hits = @write_watch_hits[index]
+                range = sprintf('0x%04x', watch[:first])
+                range += sprintf(' - 0x%04x', watch[:last]) if watch[:last] != watch[:first]
+                io.puts "<h3>Writes to #{watch[:name] ? "#{watch[:name]} (#{range})" : range}</h3>"
+                if hits.empty?
+                    io.puts "<em>No writes recorded.</em>"
+                    next
+                end
+                io.puts "<table>"
+                io.puts "<tr><th>PC</th><th>Writes</th><th>Source</th></tr>"
+                hits.group_by { |hit| hit[:pc] }.sort_by { |pc, list| -list.size }.each do |pc, list|
+                    io.puts "<tr>"
+                    io.puts "<td>#{sprintf('0x%04x', pc)}</td>"
+                    io.puts "<td style='text-align: right;'>#{list.size}</td>"
+                    io.puts "<td>#{source_line_for_pc(pc)}</td>"
+                    io.puts "</tr>"
+                end
+                io.puts "</table>"
+                io.puts "<table>"
+                io.puts "<tr><th>Cycles</th><th>PC</th><th>Address</th><th>Value</th></tr>"
+                hits.first(MAX_WRITE_WATCH_ROWS).each do |hit|
+                    io.puts "<tr>"
+                    io.puts "<td style='text-align: right;'>#{hit[:cycles]}</td>"
+                    io.puts "<td>#{sprintf('0x%04x', hit[:pc])}</td>"
+                    io.puts "<td>#{sprintf('0x%04x', hit[:address])}</td>"
+                    io.puts "<td>#{sprintf('0x%02x', hit[:value])}</td>"
+                    io.puts "</tr>"
+                end
+                io.puts "</table>"
+                if hits.size > MAX_WRITE_WATCH_ROWS
+                    io.puts "<em>#{hits.size - MAX_WRITE_WATCH_ROWS} more writes not shown.</em>"
+                end
+            end
+            report.sub!('#{write_watches}', io.string)
             if @cycles_per_function.empty?
                 report.sub!('#{cycle_watches}', '')
             else
@@ -710,6 +953,7 @@ class Champ
             io.puts "<th>Addr</th>"
             io.puts "<th>CC</th>"
             io.puts "<th>CC %</th>"
+            io.puts "<th>CC incl.</th>"
             io.puts "<th>Calls</th>"
             io.puts "<th>CC/Call</th>"
             io.puts "<th>Label</th>"
@@ -723,6 +967,7 @@ class Champ
                 io.puts "<td>#{sprintf('0x%04x', pc)}</td>"
                 io.puts "<td style='text-align: right;'>#{@total_cycles_per_function[pc]}</td>"
                 io.puts "<td style='text-align: right;'>#{sprintf('%1.2f%%', @total_cycles_per_function[pc].to_f * 100.0 / cycles_sum)}</td>"
+                io.puts "<td style='text-align: right;'>#{@inclusive_cycles_per_function[pc]}</td>"
                 io.puts "<td style='text-align: right;'>#{@calls_per_function[pc]}</td>"
                 io.puts "<td style='text-align: right;'>#{@total_cycles_per_function[pc] / @calls_per_function[pc]}</td>"
                 io.puts "<td>#{@label_for_pc[pc]}</td>"
@@ -840,6 +1085,14 @@ class Champ
         puts ' done.'
     end
 
+    # file, line and source code of the instruction at pc
+    def source_line_for_pc(pc)
+        code = @code_for_pc[pc]
+        return '' unless code
+        text = @source_for_file[code[:file]][code[:line] - 1].to_s.strip
+        "#{code[:file]}:#{code[:line]} <code>#{CGI.escapeHTML(text)}</code>"
+    end
+
     def parse_asm_int(s)
         if s[0] == '#'
             s[1, s.size - 1].to_i
@@ -908,11 +1161,19 @@ class Champ
                         if champ_directives.size != 1
                             fail('No more than one champ directive allowed in equivalence declaration.')
                         end
+                        directive = parse_champ_directive(champ_directives.first, true)
                         item = {
                             :address => code_parts[2].sub('$', '').to_i(16),
-                            :type => parse_champ_directive(champ_directives.first, true)[:type]
+                            :type => directive[:type]
                         }
                         @global_variables[label] = item
+                        if directive[:writes]
+                            @write_watches << {
+                                :name => label,
+                                :first => item[:address],
+                                :last => item[:address] + (['u16', 's16'].include?(item[:type]) ? 1 : 0)
+                            }
+                        end
                     elsif line_type == 'Code'
                         @watches[pc] ||= []
                         champ_directives.each do |directive|
@@ -949,6 +1210,11 @@ class Champ
         s = s[1, s.size - 1] if s[0] == '@'
         result[:path] = File.basename(@source_path)
         if global_variable
+            # u16(writes) also reports every write to the variable
+            if s.end_with?('(writes)')
+                result[:writes] = true
+                s = s.sub('(writes)', '')
+            end
             if ['u8', 's8', 'u16', 's16'].include?(s)
                 result[:type] = s
             else
@@ -991,8 +1257,8 @@ class Champ
 end
 
 ['p65c02', 'pgif'].each do |file|
-    unless FileUtils.uptodate?(file, ["#{file}.c"])
-        system("gcc -o #{file} #{file}.c")
+    unless FileUtils.uptodate?(file, ["#{file}.c", 'gif.c', 'gif.h'])
+        system("gcc -O2 -pthread -o #{file} #{file}.c gif.c")
         unless $?.exitstatus == 0
             exit(1)
         end
@@ -1052,6 +1318,8 @@ __END__
     #{screenshots}
     <h2>Cycles</h2>
     #{cycles}
+    #{heat_map}
+    #{page_crossings}
 </div>
 <div style='float: left; padding-right: 10px;'>
     <h2>Call Graph</h2>
@@ -1061,6 +1329,7 @@ __END__
     <h2>Watches</h2>
     #{watches}
     #{cycle_watches}
+    #{write_watches}
 </div>
 </body>
 </html>
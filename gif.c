@@ -0,0 +1,600 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include "gif.h"
+
+#pragma pack(push, 1)
+
+#define ANIMATION_OPTIMIZATION_CROP
+// split the changes of a frame into several sub-images if that's smaller
+#define ANIMATION_OPTIMIZATION_SPLIT
+// don't use transparency, it's not saving space with 1 bit graphics
+// #define ANIMATION_OPTIMIZATION_TRANSPARENCY
+
+struct header_block {
+    char signature[3];
+    char version[3];
+};
+
+struct logical_screen_descriptor {
+    uint16_t canvas_width;
+    uint16_t canvas_height;
+    uint8_t size_of_global_color_table: 3;
+    uint8_t sort_flag: 1;
+    uint8_t color_resolution: 3;
+    uint8_t global_color_table_flag: 1;
+    uint8_t background_color_index;
+    uint8_t pixel_aspect_ratio;
+};
+
+struct graphics_control_extension {
+    uint8_t extension_introducer;
+    uint8_t graphics_control_label;
+    uint8_t byte_size;
+    uint8_t transparent_color_flag: 1;
+    uint8_t user_input_flag: 1;
+    uint8_t disposal_method: 3;
+    uint8_t reserved: 3;
+    uint16_t delay_time;
+    uint8_t transparent_color_index;
+    uint8_t block_terminator;
+};
+
+struct image_descriptor {
+    uint8_t image_separator;
+    uint16_t image_left;
+    uint16_t image_top;
+    uint16_t image_width;
+    uint16_t image_height;
+    uint8_t size_of_local_color_table: 3;
+    uint8_t reserved: 2;
+    uint8_t sort_flag: 1;
+    uint8_t interlace_flag: 1;
+    uint8_t local_color_table_flag: 1;
+};
+
+struct application_extension {
+    uint8_t gif_extension_code;
+    uint8_t application_extension_label;
+    uint8_t length_of_application_block;
+    char label[11];
+    uint8_t length_of_data_sub_block;
+    uint8_t one;
+    uint16_t loop_count;
+    uint8_t terminator;
+};
+
+#pragma pack(pop)
+
+// out may be null to just measure the output size
+static void put8(FILE* out, uint8_t i)
+{
+    if (out)
+        fputc(i, out);
+}
+
+static void put_struct(FILE* out, void* p, size_t size)
+{
+    for (int i = 0; i < size; i++)
+        put8(out, *(unsigned char*)(p + i));
+}
+
+struct lzw_emitter {
+    FILE* out;
+    uint8_t byte_buffer[255];
+    uint8_t byte_buffer_size;
+    uint32_t buffer;
+    int8_t offset;
+    uint8_t code_size;
+    size_t size; // bytes written so far
+};
+
+static void flush_bytes(struct lzw_emitter* emitter)
+{
+    put8(emitter->out, emitter->byte_buffer_size);
+    put_struct(emitter->out, emitter->byte_buffer, emitter->byte_buffer_size);
+    emitter->size += 1 + emitter->byte_buffer_size;
+    emitter->byte_buffer_size = 0;
+}
+
+static void emit_byte(struct lzw_emitter* emitter)
+{
+    emitter->byte_buffer[emitter->byte_buffer_size++] = emitter->buffer & 0xff;
+    emitter->buffer >>= 8;
+    emitter->offset -= 8;
+    if (emitter->byte_buffer_size == 0xff)
+        flush_bytes(emitter);
+}
+
+static void emit_code(struct lzw_emitter* emitter, uint32_t code)
+{
+    emitter->buffer |= code << emitter->offset;
+    emitter->offset += emitter->code_size;
+    while (emitter->offset > 7)
+        emit_byte(emitter);
+}
+
+/*
+ * LZW string table: maps (prefix code, next pixel) to the code of the
+ * combined string. Open addressing with linear probing, the table is never
+ * more than half full because the encoder starts over at 2048 codes.
+ */
+#define LZW_HASH_SIZE 4096
+
+struct lzw_table {
+    uint32_t keys[LZW_HASH_SIZE]; // (prefix << 8 | suffix) + 1, 0 marks a free slot
+    uint16_t codes[LZW_HASH_SIZE];
+};
+
+static uint32_t lzw_slot(uint32_t key)
+{
+    return ((key * 0x9e3779b1u) >> 20) & (LZW_HASH_SIZE - 1);
+}
+
+// returns the code for prefix + suffix or 0xffff if there is none yet
+static uint16_t lzw_find(struct lzw_table* table, uint16_t prefix, uint8_t suffix)
+{
+    uint32_t key = (((uint32_t)prefix << 8) | suffix) + 1;
+    for (uint32_t i = lzw_slot(key); table->keys[i]; i = (i + 1) & (LZW_HASH_SIZE - 1))
+        if (table->keys[i] == key)
+            return table->codes[i];
+    return 0xffff;
+}
+
+static void lzw_insert(struct lzw_table* table, uint16_t prefix, uint8_t suffix, uint16_t code)
+{
+    uint32_t key = (((uint32_t)prefix << 8) | suffix) + 1;
+    uint32_t i = lzw_slot(key);
+    while (table->keys[i])
+        i = (i + 1) & (LZW_HASH_SIZE - 1);
+    table->keys[i] = key;
+    table->codes[i] = code;
+}
+
+static void flush_emitter(struct lzw_emitter* emitter)
+{
+    while (emitter->offset > 0)
+        emit_byte(emitter);
+    if (emitter->byte_buffer_size > 0)
+        flush_bytes(emitter);
+}
+
+struct rect {
+    uint16_t left;
+    uint16_t top;
+    uint16_t width;
+    uint16_t height;
+};
+
+// a frame and its predecessor, plus the dirty map, if any
+struct frame_diff {
+    uint8_t* pixels;
+    uint8_t* previous_pixels;
+    uint16_t width;
+    const struct gif_dirty_map* dirty;
+    uint16_t blocks_per_line;
+};
+
+static uint8_t dirty_bit(const uint8_t* bitmap, uint32_t index)
+{
+    return (bitmap[index >> 3] >> (index & 7)) & 1;
+}
+
+static uint8_t same_pixels(struct frame_diff* diff, int offset, int count)
+{
+    return memcmp(diff->pixels + offset, diff->previous_pixels + offset, count) == 0;
+}
+
+static uint8_t same_row(struct frame_diff* diff, struct rect* r, int y)
+{
+    int offset = y * diff->width;
+    if (!diff->dirty)
+        return same_pixels(diff, offset + r->left, r->width);
+    if (!dirty_bit(diff->dirty->rows, y))
+        return 1;
+    // only compare the dirty blocks within r
+    uint16_t block_width = diff->dirty->block_width;
+    int right = r->left + r->width;
+    for (int block = r->left / block_width; block * block_width < right; block++)
+    {
+        if (!dirty_bit(diff->dirty->blocks, y * diff->blocks_per_line + block))
+            continue;
+        int left = block * block_width;
+        int end = left + block_width;
+        if (left < r->left)
+            left = r->left;
+        if (end > right)
+            end = right;
+        if (!same_pixels(diff, offset + left, end - left))
+            return 0;
+    }
+    return 1;
+}
+
+static uint8_t same_column(struct frame_diff* diff, struct rect* r, int x)
+{
+    int block = diff->dirty ? x / diff->dirty->block_width : 0;
+    for (int y = r->top; y < r->top + r->height; y++)
+    {
+        if (diff->dirty && !(dirty_bit(diff->dirty->rows, y) &&
+                             dirty_bit(diff->dirty->blocks, y * diff->blocks_per_line + block)))
+            continue;
+        int offset = y * diff->width + x;
+        if (diff->pixels[offset] != diff->previous_pixels[offset])
+            return 0;
+    }
+    return 1;
+}
+
+// shrinks r to the bounding box of all changed pixels within r
+static void crop_rect(struct frame_diff* diff, struct rect* r)
+{
+    // crop left and right
+    while (r->width > 0 && same_column(diff, r, r->left))
+    {
+        r->left++;
+        r->width--;
+    }
+    while (r->width > 0 && same_column(diff, r, r->left + r->width - 1))
+        r->width--;
+
+    // crop top and bottom
+    while (r->height > 0 && same_row(diff, r, r->top))
+    {
+        r->top++;
+        r->height--;
+    }
+    while (r->height > 0 && same_row(diff, r, r->top + r->height - 1))
+        r->height--;
+}
+
+#ifdef ANIMATION_OPTIMIZATION_SPLIT
+/*
+ * Estimated size of a sub-image in bytes: graphics control extension,
+ * image descriptor, LZW framing and the pixels at color_depth bits each.
+ * LZW usually does better than that, but it's the same factor for all
+ * candidates, so it's good enough to compare them.
+ */
+#define SUB_IMAGE_OVERHEAD 24
+#define MAX_SUB_IMAGES 16
+
+static uint32_t rect_cost(struct rect* r, uint8_t color_depth)
+{
+    return SUB_IMAGE_OVERHEAD + (uint32_t)r->width * r->height * color_depth / 8;
+}
+
+/*
+ * Recursively splits a cropped rect along the widest run of unchanged rows
+ * or columns, as long as the two cropped halves are estimated to be cheaper
+ * than the whole. Appends the resulting rects to rects and returns the new
+ * count.
+ */
+static int split_rect(struct frame_diff* diff, uint8_t color_depth, struct rect r,
+                      struct rect* rects, int count, int max_count)
+{
+    if (count + 1 < max_count)
+    {
+        struct rect best_a, best_b;
+        uint32_t best_cost = rect_cost(&r, color_depth);
+        for (int dir = 0; dir < 2; dir++)
+        {
+            // find the widest gap of unchanged rows (dir 0) or columns (dir 1)
+            int first = (dir == 0) ? r.top : r.left;
+            int length = (dir == 0) ? r.height : r.width;
+            int gap_start = 0;
+            int gap_length = 0;
+            int run_start = 0;
+            for (int i = first; i < first + length; i++)
+            {
+                uint8_t same = (dir == 0) ?
+                    same_row(diff, &r, i) :
+                    same_column(diff, &r, i);
+                if (!same)
+                    run_start = i + 1;
+                else if (i + 1 - run_start > gap_length)
+                {
+                    gap_start = run_start;
+                    gap_length = i + 1 - run_start;
+                }
+            }
+            if (gap_length == 0)
+                continue;
+            struct rect a = r;
+            struct rect b = r;
+            if (dir == 0)
+            {
+                a.height = gap_start - r.top;
+                b.top = gap_start + gap_length;
+                b.height = r.top + r.height - b.top;
+            }
+            else
+            {
+                a.width = gap_start - r.left;
+                b.left = gap_start + gap_length;
+                b.width = r.left + r.width - b.left;
+            }
+            crop_rect(diff, &a);
+            crop_rect(diff, &b);
+            uint32_t cost = rect_cost(&a, color_depth) + rect_cost(&b, color_depth);
+            if (cost < best_cost)
+            {
+                best_cost = cost;
+                best_a = a;
+                best_b = b;
+            }
+        }
+        if (best_cost < rect_cost(&r, color_depth))
+        {
+            count = split_rect(diff, color_depth, best_a, rects, count, max_count - 1);
+            return split_rect(diff, color_depth, best_b, rects, count, max_count);
+        }
+    }
+    rects[count++] = r;
+    return count;
+}
+#endif
+
+// writes one image and returns its size in bytes, out may be null
+static size_t write_sub_image(FILE* out, uint8_t* pixels, uint8_t* previous_pixels,
+                            uint16_t width, struct rect* r, uint8_t colors_used,
+                            uint8_t color_depth, uint16_t frame_delay)
+{
+    int16_t transparent_color = -1;
+
+    #ifdef ANIMATION_OPTIMIZATION_TRANSPARENCY
+    // replace unchanged pixels with tranparency
+    if (previous_pixels && colors_used < 255)
+    {
+        transparent_color = colors_used;
+        colors_used++;
+        while (colors_used >= (1 << color_depth))
+            color_depth++;
+        for (int y = 0; y < r->height; y++)
+        {
+            uint32_t offset = (y + r->top) * width + r->left;
+            uint8_t* p = pixels + offset;
+            uint8_t* pp = previous_pixels + offset;
+            for (int x = 0; x < r->width; x++)
+            {
+                if (*p == *pp)
+                {
+                    *p = (uint8_t)transparent_color;
+                }
+                p++;
+                pp++;
+            }
+        }
+    }
+    #else
+    (void)previous_pixels;
+    (void)colors_used;
+    #endif
+
+    // write graphics control extension
+    struct graphics_control_extension gce;
+    memset(&gce, 0, sizeof(gce));
+    gce.extension_introducer = 0x21;
+    gce.graphics_control_label = 0xf9;
+    gce.byte_size = 4;
+    gce.disposal_method = 1; // draw on top
+    gce.delay_time = frame_delay; // in 1/100 seconds
+
+    if (transparent_color >= 0)
+    {
+        gce.transparent_color_flag = 1;
+        gce.transparent_color_index = transparent_color;
+    }
+    put_struct(out, &gce, sizeof(gce));
+
+    // write image descriptor
+    struct image_descriptor id;
+    memset(&id, 0, sizeof(id));
+    id.image_separator = 0x2c;
+    id.image_left = r->left;
+    id.image_top = r->top;
+    id.image_width = r->width;
+    id.image_height = r->height;
+    put_struct(out, &id, sizeof(id));
+
+    uint8_t lzw_minimum_code_size = color_depth;
+//     if (lzw_minimum_code_size < 2)
+//         lzw_minimum_code_size = 2;
+
+    put8(out, lzw_minimum_code_size);
+
+    struct lzw_emitter emitter;
+    emitter.out = out;
+    emitter.byte_buffer_size = 0;
+    emitter.buffer = 0;
+    emitter.offset = 0;
+    emitter.code_size = lzw_minimum_code_size + 1;
+    emitter.size = 0;
+
+    // set up LZW encoder
+    uint16_t clear_code = (1 << color_depth);
+    uint16_t end_of_information_code = clear_code + 1;
+
+    struct lzw_table* table = malloc(sizeof(struct lzw_table));
+    if (!table)
+    {
+        fprintf(stderr, "Error allocating LZW table.\n");
+        exit(1);
+    }
+    memset(table->keys, 0, sizeof(table->keys));
+    uint16_t table_length = 0;
+
+    emit_code(&emitter, clear_code);
+
+    uint16_t index_buffer = 0;
+    for (int y = 0; y < r->height; y++)
+    {
+        uint8_t* p = pixels + (y + r->top) * width + r->left;
+        for (int x = 0; x < r->width; x++)
+        {
+            if (x == 0 && y == 0)
+            {
+                index_buffer = (uint16_t)(*(p++));
+                continue;
+            }
+            uint8_t k = *(p++);
+            uint16_t found_table_entry = lzw_find(table, index_buffer, k);
+            if (found_table_entry < 0xffff)
+                index_buffer = found_table_entry;
+            else
+            {
+                lzw_insert(table, index_buffer, k, table_length + end_of_information_code + 1);
+                table_length += 1;
+                if (table_length + end_of_information_code > (1 << emitter.code_size))
+                    emitter.code_size++;
+                emit_code(&emitter, index_buffer);
+                index_buffer = k;
+                if (table_length >= 2048 - 1 - end_of_information_code)
+                {
+                    emit_code(&emitter, clear_code);
+                    table_length = 0;
+                    memset(table->keys, 0, sizeof(table->keys));
+                    emitter.code_size = lzw_minimum_code_size + 1;
+                }
+            }
+        }
+    }
+
+    // the decoder already expects wider codes if the last entry filled up the current width
+    if (table_length + end_of_information_code == (1 << emitter.code_size))
+        emitter.code_size++;
+    emit_code(&emitter, index_buffer);
+    // reading that code adds one more entry (unless it directly follows a
+    // clear code), which may widen the end of information code as well
+    if (table_length > 0 && table_length + end_of_information_code + 1 == (1 << emitter.code_size))
+        emitter.code_size++;
+    emit_code(&emitter, end_of_information_code);
+    flush_emitter(&emitter);
+
+    free(table);
+
+    put8(out, 0);
+
+    return sizeof(gce) + sizeof(id) + 1 + emitter.size + 1;
+}
+
+void encode_image(FILE* out, uint8_t* pixels, uint8_t* previous_pixels,
+                  uint16_t width, uint16_t height,
+                  uint8_t colors_used, uint16_t frame_delay,
+                  const struct gif_dirty_map* dirty)
+{
+    uint8_t color_depth = 1;
+    while (colors_used > (1 << color_depth))
+        color_depth++;
+    if (color_depth < 2)
+        color_depth = 2;
+
+    struct rect whole = {0, 0, width, height};
+    struct rect* rects = &whole;
+    int rect_count = 1;
+
+    #ifdef ANIMATION_OPTIMIZATION_SPLIT
+    struct rect split_rects[MAX_SUB_IMAGES];
+    #endif
+
+    if (previous_pixels)
+    {
+        // if previous_pixels is not null, we can do some differential encoding!
+        struct frame_diff diff = {pixels, previous_pixels, width, dirty, 0};
+        if (dirty)
+            diff.blocks_per_line = (width + dirty->block_width - 1) / dirty->block_width;
+
+        #ifdef ANIMATION_OPTIMIZATION_CROP
+        crop_rect(&diff, &whole);
+        #endif
+
+        #ifdef ANIMATION_OPTIMIZATION_SPLIT
+        /*
+         * Sub-images get drawn one after another, and browsers stretch
+         * delays below 2/100 seconds to 1/10 seconds, so every sub-image
+         * but the last gets shown for 2/100 seconds and the last one gets
+         * the rest of the frame delay. Thus, short frames don't get split.
+         */
+        int max_count = frame_delay / 2;
+        if (max_count > MAX_SUB_IMAGES)
+            max_count = MAX_SUB_IMAGES;
+        if (max_count > 1 && whole.width > 0)
+        {
+            int split_count = split_rect(&diff, color_depth, whole, split_rects, 0, max_count);
+            // the estimate can be off, so check the actual sizes before splitting
+            if (split_count > 1)
+            {
+                size_t split_size = 0;
+                for (int i = 0; i < split_count; i++)
+                    split_size += write_sub_image(0, pixels, previous_pixels, width, &split_rects[i],
+                                                  colors_used, color_depth, 0);
+                if (split_size < write_sub_image(0, pixels, previous_pixels, width, &whole,
+                                                 colors_used, color_depth, 0))
+                {
+                    rects = split_rects;
+                    rect_count = split_count;
+                }
+            }
+        }
+        #endif
+    }
+
+    for (int i = 0; i < rect_count; i++)
+    {
+        uint16_t delay = (i + 1 < rect_count) ? 2 : frame_delay - (rect_count - 1) * 2;
+        write_sub_image(out, pixels, previous_pixels, width, &rects[i],
+                        colors_used, color_depth, delay);
+    }
+}
+
+void write_gif_header(FILE* out, uint16_t width, uint16_t height,
+                      uint16_t colors_used, const uint8_t* palette)
+{
+    uint8_t color_depth = 1;
+    while (colors_used > (1 << color_depth))
+        color_depth++;
+    if (color_depth < 2)
+        color_depth = 2;
+
+    // write header
+    struct header_block header;
+    memcpy(header.signature, "GIF", 3);
+    memcpy(header.version, "89a", 3);
+    put_struct(out, &header, sizeof(header));
+
+    // write logical screen descriptor
+    struct logical_screen_descriptor lsd;
+    memset(&lsd, 0, sizeof(lsd));
+    lsd.canvas_width = width;
+    lsd.canvas_height = height;
+    lsd.size_of_global_color_table = color_depth - 1;
+    lsd.color_resolution = color_depth - 1;
+    lsd.global_color_table_flag = 1;
+    put_struct(out, &lsd, sizeof(lsd));
+
+    // write global color table
+    put_struct(out, (void*)palette, colors_used * 3);
+
+    // fill remaining colors, if any
+    for (int i = colors_used; i < (1 << color_depth); i++)
+    {
+        put8(out, 0); put8(out, 0); put8(out, 0);
+    }
+
+    // write application extension NETSCAPE2.0 to loop the animation
+    // (otherwise it just plays once, duh...)
+    struct application_extension ae;
+    memset(&ae, 0, sizeof(ae));
+    ae.gif_extension_code = 0x21;
+    ae.application_extension_label = 0xff;
+    ae.length_of_application_block = 0x0b;
+    memcpy(ae.label, "NETSCAPE2.0", 0x0b);
+    ae.length_of_data_sub_block = 3;
+    ae.one = 1;
+    put_struct(out, &ae, sizeof(ae));
+}
+
+void write_gif_trailer(FILE* out)
+{
+    put8(out, 0x3b);
+}
@@ -0,0 +1,39 @@
+#ifndef GIF_H
+#define GIF_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+ * Animated GIF encoder used by pgif and p65c02. Write the header once,
+ * then any number of frames, then the trailer. Every frame is compared to
+ * the previous one (if any) and cropped to the changed area, which gets
+ * split into several sub-images if the changes are far apart.
+ */
+
+// palette holds colors_used RGB triples
+void write_gif_header(FILE* out, uint16_t width, uint16_t height,
+                      uint16_t colors_used, const uint8_t* palette);
+
+/*
+ * Tells the encoder which parts of a frame may have changed, so it only
+ * has to compare those with the previous frame. Every line is divided into
+ * blocks of block_width pixels. Pixels in blocks whose bit is clear, or in
+ * lines whose bit is clear, must be the same as in the previous frame.
+ * Bits are stored lowest bit first.
+ */
+struct gif_dirty_map {
+    uint16_t block_width;
+    const uint8_t* rows; // one bit per line
+    const uint8_t* blocks; // one bit per block, line by line
+};
+
+// pixels holds one color index per pixel, previous_pixels and dirty may be null
+void encode_image(FILE* out, uint8_t* pixels, uint8_t* previous_pixels,
+                  uint16_t width, uint16_t height,
+                  uint8_t colors_used, uint16_t frame_delay,
+                  const struct gif_dirty_map* dirty);
+
+void write_gif_trailer(FILE* out);
+
+#endif
@@ -1,9 +1,23 @@
 #include <stdio.h>
 #include <stdint.h>
+#include <stdarg.h>
+#include <inttypes.h>
 #include <string.h>
 #include <stdlib.h>
 #include <time.h>
 #include <unistd.h>
+#include <signal.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "gif.h"
+
+#if defined(__GNUC__)
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define ALWAYS_INLINE inline
+#endif
 
 #define SCREEN_WIDTH 280
 #define SCREEN_HEIGHT 192
@@ -16,26 +30,7 @@
 #define OVERFLOW            0x40
 #define NEGATIVE            0x80
 
-uint8_t show_log = 1;
-uint8_t show_screen = 1;
-uint8_t show_call_stack = 0;
-
-uint8_t trace_stack[0x100];
-uint8_t trace_stack_pointer = 0xff;
-uint16_t trace_stack_function[0x100];
-uint64_t cycles_per_function[0x10000];
-uint64_t calls_per_function[0x10000];
-uint64_t last_frame_cycle_count = 0;
-uint64_t frame_cycle_count = 0;
-uint64_t frame_count = 0;
-
-uint16_t start_pc = 0x6000;
-uint16_t start_frame_pc = 0xffff;
-uint16_t old_pc = 0;
-
-uint8_t brk_encountered = 0;
-
-uint16_t yoffset[192] = {
+const uint16_t yoffset[192] = {
     0x0000, 0x0400, 0x0800, 0x0c00, 0x1000, 0x1400, 0x1800, 0x1c00,
     0x0080, 0x0480, 0x0880, 0x0c80, 0x1080, 0x1480, 0x1880, 0x1c80,
     0x0100, 0x0500, 0x0900, 0x0d00, 0x1100, 0x1500, 0x1900, 0x1d00,
@@ -67,6 +62,11 @@ typedef struct {
     uint8_t sp;
     uint64_t total_cycles;
     uint8_t a, x, y, flags;
+    // carry, zero and negative flags are evaluated lazily, their bits in
+    // flags are only valid after get_flags()
+    uint8_t carry; // 0 or 1
+    uint8_t zero_result; // Z is set if this is 0
+    uint8_t negative_result; // N is bit 7 of this
 } r_cpu;
 
 void init_cpu(r_cpu* cpu)
@@ -78,11 +78,11 @@ void init_cpu(r_cpu* cpu)
     cpu->x = 0;
     cpu->y = 0;
     cpu->flags = 0x20; // bit 5 is always set
+    cpu->carry = 0;
+    cpu->zero_result = 1;
+    cpu->negative_result = 0;
 }
 
-uint8_t ram[0x10000];
-r_cpu cpu;
-
 typedef struct {
     uint32_t index;
     uint16_t pc;
@@ -100,12 +100,440 @@ typedef struct {
     uint16_t memory_address;
 } r_watch;
 
-r_watch *watches = 0;
-uint8_t watches_allocated = 0;
-size_t watch_count = 0;
-int32_t watch_offset_for_pc_and_post[0x20000];
+/*
+ * Events are written to stdout as a stream of binary records, preceded by
+ * a stream header. Every record consists of a type byte and a little endian
+ * 16 bit payload length, followed by the payload. All records except error
+ * and screen records have a fixed size. stdout is fully buffered and only
+ * gets flushed on errors and at exit.
+ *
+ * With --text-events, the old line based format gets written instead and
+ * flushed after every event, which is handy for debugging.
+ *
+ * Calls are not reported one by one. The emulator keeps a profile of all
+ * functions called via JSR and writes it as a block of function and call
+ * edge records at the end of the run (BRK, error or SIGINT), preceded by the
+ * exact cycle count. Only functions requested with --call-events get a call
+ * record every time they return. A frame statistics record follows, if at
+ * least one frame has been completed.
+ *
+ * Writes to addresses watched with --write-watch are reported one by one,
+ * with the PC of the writing instruction and the cycle count before it.
+ * With --heat-map, the profile ends with one heat map record for every
+ * page and kind of access which has been counted at least once.
+ * With --page-crossings, it ends with one record for every executed
+ * instruction, which splits its cycles into base cycles and penalties.
+ */
+#define EVENT_PROTOCOL_VERSION 7
+
+typedef enum {
+    EVENT_ERROR = 1,
+    EVENT_LOG,
+    EVENT_CALL,
+    EVENT_WATCH,
+    EVENT_SCREEN,
+    EVENT_CYCLES,
+    EVENT_FUNCTION,
+    EVENT_CALL_EDGE,
+    EVENT_FRAME_STATS,
+    EVENT_WRITE_WATCH,
+    EVENT_HEAT_MAP,
+    EVENT_PC_CYCLES
+} r_event_type;
+
+#pragma pack(push, 1)
+
+typedef struct {
+    char magic[4];
+    uint8_t version;
+} r_event_stream_header;
+
+typedef struct {
+    uint8_t type;
+    uint16_t length;
+} r_event_header;
+
+typedef struct {
+    uint16_t pc;
+    uint8_t a, x, y;
+    uint16_t next_pc;
+    uint8_t sp, flags;
+} r_log_event;
+
+typedef struct {
+    uint16_t pc;
+    uint64_t cycles; // at return
+    uint64_t call_cycles; // from JSR to RTS, including called functions
+} r_call_event;
+
+typedef struct {
+    uint16_t pc;
+    uint64_t calls;
+    uint64_t exclusive_cycles; // spent in the function itself
+    uint64_t inclusive_cycles; // including called functions
+} r_function_event;
+
+typedef struct {
+    uint16_t caller; // start PC for calls from outside any function
+    uint16_t callee;
+    uint64_t count;
+} r_call_edge_event;
+
+#define FRAME_HISTOGRAM_BINS 32
+
+/*
+ * Durations of all completed frames in cycles. A frame starts whenever the
+ * PC hits the frame start (--start-frame) or, without one, at every screen.
+ * Histogram bin i counts durations from min + i * bin_width on.
+ */
+typedef struct {
+    uint8_t mode; // 0: screens, 1: frame start
+    uint32_t count;
+    uint64_t min;
+    uint64_t max;
+    uint64_t mean;
+    uint64_t p50;
+    uint64_t p95;
+    uint64_t p99;
+    uint64_t bin_width;
+    uint32_t histogram[FRAME_HISTOGRAM_BINS];
+} r_frame_stats_event;
+
+typedef struct {
+    uint16_t subroutine;
+    uint32_t index;
+    uint64_t cycles;
+    uint8_t value_count;
+    int32_t values[2];
+} r_watch_event;
+
+typedef struct {
+    uint16_t address;
+    uint8_t value;
+    uint16_t pc;
+    uint64_t cycles; // before the writing instruction
+} r_write_watch_event;
+
+// --heat-map: accesses per address, counted in read8(), handle_flagged_write()
+// and handle_next_opcode()
+#define HEAT_MAP_READS   0
+#define HEAT_MAP_WRITES  1
+#define HEAT_MAP_FETCHES 2 // opcode and operand bytes of executed instructions
+#define HEAT_MAP_KINDS   3
+
+typedef struct {
+    uint8_t kind;
+    uint8_t page;
+    uint64_t counts[0x100];
+} r_heat_map_event;
+
+// --page-crossings: cycles of the instruction at pc, see record_pc_cycles()
+typedef struct {
+    uint16_t pc;
+    uint64_t count;
+    uint64_t base_cycles;
+    uint64_t page_crossing_cycles; // indexed addressing crossing a page
+    uint64_t branch_taken_cycles;
+    uint64_t branch_page_crossing_cycles; // branch target on another page
+} r_pc_cycles_event;
+
+#pragma pack(pop)
+
+/*
+ * Predecoded basic blocks, keyed by start PC. A block ends after a control
+ * flow instruction, before the frame start PC, right after an instruction
+ * with a watch (which always starts its own block), and after at most
+ * MAX_BLOCK_INSTRUCTIONS instructions. Blocks are allocated from a fixed
+ * pool which gets flushed completely once it runs full.
+ *
+ * Writing to a page which contains cached code invalidates all blocks
+ * touching that page. Pages which get invalidated too often (self-modifying
+ * code in a tight loop) are not cached anymore and get interpreted instead.
+ */
+#define MAX_BLOCK_INSTRUCTIONS 32
+#define BLOCK_POOL_SIZE 0x4000
+#define MAX_PAGE_INVALIDATIONS 64
+
+#define WRITE_FLAG_CODE          0x01
+#define WRITE_FLAG_SCREEN_SWITCH 0x02
+#define WRITE_FLAG_SCREEN        0x04
+#define WRITE_FLAG_LOG           0x08 // --lockstep, see record_write()
+#define WRITE_FLAG_IO            0x10 // see register_io_page()
+#define WRITE_FLAG_WATCH         0x20 // --write-watch, see write_watched
+#define WRITE_FLAG_HEAT_MAP      0x40 // --heat-map, set on all pages
+
+typedef struct {
+    uint16_t pc;
+    uint16_t next_pc;
+    uint16_t operand;
+    uint8_t read_opcode;
+} r_block_instruction;
+
+typedef uint8_t (*r_jit_function)(void);
+
+typedef struct r_block {
+    uint16_t start_pc;
+    uint16_t end_pc; // first address behind the last instruction
+    uint16_t branch_target; // target of the final branch, JMP or JSR, if any
+    uint16_t cycles; // sum of base cycles, without page crossing penalties
+    uint8_t instruction_count;
+    uint8_t entry_count; // counts up to JIT_THRESHOLD
+    r_jit_function jit_function; // native code, if the block is hot
+    struct r_block* next_in_page;
+    r_block_instruction instructions[MAX_BLOCK_INSTRUCTIONS];
+} r_block;
+
+/*
+ * Optional JIT tier for x86-64 (--jit). Blocks which have been entered
+ * JIT_THRESHOLD times get translated to native code, as far as their
+ * instructions are supported. The remaining instructions of a block, if
+ * any, are executed by the interpreter. The native code works directly on
+ * cpu and ram and keeps the exact same cycle count as the interpreter,
+ * including page crossing penalties. It leaves the block after a write to a
+ * flagged page (screen switch or cached code), just like run_block().
+ *
+ * Native code lives in an mmap'd executable buffer and gets discarded
+ * together with the block cache. With --jit-verify, every native block is
+ * checked against the interpreter, starting from the same state.
+ */
+#if defined(__x86_64__) && !defined(NO_JIT)
+#define JIT
+#endif
+
+#ifdef JIT
+#include <sys/mman.h>
+
+#define JIT_BUFFER_SIZE 0x1000000
+#define JIT_MAX_BLOCK_CODE_SIZE 0x4000
+#define JIT_THRESHOLD 32
+
+// x86 registers used by the generated code: rbx points to cpu, r12 to ram,
+// r13 to write_page_flags and r14 accumulates page crossing penalties
+#define EAX 0
+#define ECX 1
+#define EDX 2
+#define EBX 3
+#define ESI 6
+#define EDI 7
+
+// x86 ALU opcode extensions for 0x81 /n
+#define X86_ADD 0
+#define X86_OR  1
+#define X86_AND 4
+#define X86_SUB 5
+#define X86_XOR 6
+#define X86_CMP 7
+
+// x86 condition codes
+#define CC_B  0x2
+#define CC_AE 0x3
+#define CC_E  0x4
+#define CC_NE 0x5
+#define CC_BE 0x6
+#define CC_A  0x7
+#endif
+
+// open addressing hash table entry, count 0 marks a free slot
+typedef struct {
+    uint32_t key; // caller << 16 | callee
+    uint64_t count;
+} r_call_edge;
+
+#define INITIAL_CALL_EDGE_CAPACITY 0x400
+
+/*
+ * When screens get shown or recorded, writes to both hi-res pages are
+ * tracked (WRITE_FLAG_SCREEN). For every screen, this yields the lines and
+ * bytes which may differ from the previous screen, so that the GIF encoder
+ * only has to compare those, and the number of bytes of the page being
+ * shown which the program wrote since the previous screen.
+ */
+typedef struct {
+    uint8_t rows[192 / 8]; // one bit per line, lowest bit first
+    uint8_t bytes[40 * 192 / 8]; // one bit per byte, line by line
+    uint16_t redrawn;
+} r_screen_changes;
+
+// a write to memory, recorded with --lockstep
+typedef struct {
+    uint16_t address;
+    uint8_t value;
+} r_memory_write;
+
+// where the cycles of an instruction went, summed up over all executions
+typedef struct {
+    uint64_t count;
+    uint64_t base_cycles;
+    uint64_t page_crossing_cycles;
+    uint64_t branch_taken_cycles;
+    uint64_t branch_page_crossing_cycles;
+} r_pc_cycles;
+
+/*
+ * Memory accesses go through a table with a read and a write handler per
+ * page. Plain RAM pages have no handlers and are accessed directly. Writes
+ * only check write_page_flags, as before, and runs without any read handler
+ * skip the table for reads altogether (RUN_IO). Handlers are called for
+ * data reads and writes, instruction fetches and the stack always go to
+ * RAM. A write handler gets called after the value has been stored in RAM.
+ */
+struct r_context;
+typedef uint8_t (*r_read_handler)(struct r_context* ctx, uint16_t address);
+typedef void (*r_write_handler)(struct r_context* ctx, uint16_t address, uint8_t value);
+
+// a memory address which always reads as the same value (--io-value)
+typedef struct {
+    uint16_t address;
+    uint8_t value;
+} r_io_value;
+
+#define MAX_IO_VALUES 64
+
+/*
+ * Everything belonging to a single emulator run. All functions get their
+ * context passed explicitly, so that several runs can execute in parallel
+ * on different threads (--batch).
+ */
+typedef struct r_context {
+    // options
+    uint8_t show_log;
+    uint8_t show_screen;
+    uint8_t text_events;
+    uint8_t use_block_cache;
+    uint16_t start_pc;
+    uint16_t start_frame_pc;
+    uint32_t log_ring_size;
+    uint64_t max_frames; // 0 = unlimited
+    uint64_t max_cycles; // 0 = unlimited
+    uint64_t max_instructions; // 0 = unlimited
+    uint8_t bench; // no output, report host time per instruction instead
+    uint8_t lockstep; // compare with the reference interpreter, see run_lockstep()
+    uint8_t record_heat_map;
+    uint8_t record_page_crossings;
+    uint8_t soft_switches; // Apple II keyboard at $C000, see access_soft_switch()
+    char* keys; // typed on the keyboard, one after another
+    size_t key_count; // length of keys
+    r_io_value io_values[MAX_IO_VALUES];
+    uint32_t io_value_count;
+#ifdef JIT
+    uint8_t use_jit;
+    uint8_t jit_verify;
+#endif
+    FILE* out; // event stream
+    FILE* frames; // pgif input stream, see emit_frame()
+    FILE* gif_file; // --gif, handed to the encoder thread
+    struct r_gif_encoder* gif;
+    jmp_buf error_exit; // taken by stop_run() once an error has been reported
+
+    r_cpu cpu;
+    uint8_t ram[0x10000];
+    uint16_t old_pc;
+    uint8_t brk_encountered;
+    uint8_t interrupted;
+    uint8_t running; // the event stream header has been written
+    uint64_t instruction_count;
+    uint64_t run_nanoseconds; // host time spent in the main loop
+
+    uint8_t trace_stack[0x100];
+    uint8_t trace_stack_pointer;
+    uint16_t trace_stack_function[0x100];
+    uint64_t trace_stack_cycles[0x100]; // total cycles at JSR
+    uint64_t cycles_per_function[0x10000]; // exclusive
+    uint64_t inclusive_cycles_per_function[0x10000];
+    uint64_t calls_per_function[0x10000];
+    uint32_t active_calls_per_function[0x10000]; // recursion depth
+    uint8_t call_events_for_function[0x10000];
+    r_call_edge* call_edges;
+    uint32_t call_edge_capacity;
+    uint32_t call_edge_count;
+    uint32_t* frame_durations; // in cycles, see record_frame_start()
+    uint32_t frame_duration_capacity;
+    uint32_t frame_duration_count;
+    uint64_t frame_start_cycles;
+    uint8_t frame_started;
+    uint64_t screen_count;
+    // one bit per address from $2000 to $5fff, see collect_screen_changes()
+    uint8_t screen_written[0x4000 / 8]; // since the last screen
+    uint8_t screen_stale[0x4000 / 8]; // may differ from the last screen
+    uint8_t pending_screen[40 * 192]; // see record_screen()
+    r_screen_changes pending_screen_changes;
+    uint64_t pending_screen_cycles;
+    uint8_t has_pending_screen;
+    uint64_t recorded_frames;
+    uint16_t frames_delay; // last delay written with --frames
+    uint16_t recorded_delay; // of the last recorded frame
+
+    r_watch* watches;
+    size_t watch_count;
+    int32_t watch_offset_for_pc_and_post[0x20000];
+    // one bit per address, only looked at on pages with WRITE_FLAG_WATCH
+    uint8_t write_watched[0x10000 / 8];
+    uint8_t has_write_watches;
+    uint64_t* heat_map; // HEAT_MAP_KINDS blocks of 0x10000 counters
+    r_pc_cycles* pc_cycles; // one per PC, --page-crossings
+
+    r_log_event* log_ring;
+    uint32_t log_ring_position;
+    uint8_t log_ring_full;
+    sig_atomic_t log_dumps_handled;
+
+    r_block* block_pool;
+    uint32_t block_pool_used;
+    r_block* block_for_pc[0x10000];
+    r_block* blocks_for_page[0x100];
+    uint8_t page_invalidations[0x100];
+    uint8_t write_page_flags[0x100];
+    uint8_t block_exit;
+
+    r_read_handler read_handlers[0x100];
+    r_write_handler write_handlers[0x100];
+    uint32_t read_handler_count; // pages with a read handler
+    uint32_t key_position;
+    // --io-value per address, filled by register_io_pages()
+    uint8_t io_value_set[0x10000 / 8];
+    uint8_t io_value_for_address[0x10000];
+
+    r_memory_write* write_log; // since the last lockstep comparison
+    uint32_t write_log_capacity;
+    uint32_t write_log_count;
+    struct r_context* reference; // --lockstep
+    uint8_t lockstep_mismatch;
+
+#ifdef JIT
+    uint8_t jit_flush_requested;
+    uint8_t* jit_buffer;
+    uint32_t jit_buffer_used;
+#endif
+} r_context;
+
+// ends the current run after an error has been reported
+void stop_run(r_context* ctx)
+{
+    fflush(ctx->out);
+    longjmp(ctx->error_exit, 1);
+}
+
+// builds the complete status register from the lazily evaluated flags
+uint8_t get_flags(r_context* ctx)
+{
+    uint8_t flags = ctx->cpu.flags & ~(CARRY | ZERO | NEGATIVE);
+    if (ctx->cpu.carry)
+        flags |= CARRY;
+    if (ctx->cpu.zero_result == 0)
+        flags |= ZERO;
+    flags |= ctx->cpu.negative_result & NEGATIVE;
+    return flags;
+}
+
+void set_flags(r_context* ctx, uint8_t flags)
+{
+    ctx->cpu.flags = flags;
+    ctx->cpu.carry = flags & CARRY;
+    ctx->cpu.zero_result = (flags & ZERO) ? 0 : 1;
+    ctx->cpu.negative_result = flags & NEGATIVE;
+}
 
-void load(char* path, uint16_t offset)
+void load(r_context* ctx, const char* path, uint16_t offset)
 {
     uint8_t buffer[0x10000];
     size_t size;
@@ -114,221 +542,1129 @@ void load(char* path, uint16_t offset)
     if (!f)
     {
         fprintf(stderr, "Error reading file: %s\n", path);
-        exit(1);
+        stop_run(ctx);
     }
     size = fread(buffer, 1, 0x10000, f);
-    memcpy(ram + offset, buffer, size);
+    memcpy(ctx->ram + offset, buffer, size);
     fclose(f);
 }
 
-uint8_t rpc8()
+void write_event_header(r_context* ctx, uint8_t type, uint16_t length)
 {
-    return ram[cpu.pc++];
+    r_event_header header;
+    header.type = type;
+    header.length = length;
+    fwrite(&header, sizeof(header), 1, ctx->out);
 }
 
-uint16_t rpc16()
+void write_event(r_context* ctx, uint8_t type, const void* payload, uint16_t length)
 {
-    uint16_t result = rpc8();
-    result |= ((uint16_t)rpc8()) << 8;
-    return result;
+    write_event_header(ctx, type, length);
+    fwrite(payload, length, 1, ctx->out);
 }
 
-uint8_t read8(uint16_t address)
+void emit_stream_header(r_context* ctx)
 {
-    return ram[address];
+    if (ctx->text_events)
+        return;
+    r_event_stream_header header;
+    memcpy(header.magic, "CHMP", 4);
+    header.version = EVENT_PROTOCOL_VERSION;
+    fwrite(&header, sizeof(header), 1, ctx->out);
 }
 
-uint16_t read16(uint16_t address)
+/*
+ * The execution log is kept in a ring buffer of the most recent CPU states
+ * and only gets written when an error occurs or when SIGUSR1 is received.
+ */
+volatile sig_atomic_t log_dump_requests = 0;
+
+void record_log(r_context* ctx, uint16_t pc)
 {
-    uint16_t result = read8(address);
-    result |= ((uint16_t)read8(address + 1)) << 8;
-    return result;
+    r_log_event* event = &ctx->log_ring[ctx->log_ring_position++];
+    if (ctx->log_ring_position == ctx->log_ring_size)
+    {
+        ctx->log_ring_position = 0;
+        ctx->log_ring_full = 1;
+    }
+    event->pc = pc;
+    event->a = ctx->cpu.a;
+    event->x = ctx->cpu.x;
+    event->y = ctx->cpu.y;
+    event->next_pc = ctx->cpu.pc;
+    event->sp = ctx->cpu.sp;
+    event->flags = get_flags(ctx);
+}
+
+void emit_log(r_context* ctx, r_log_event* event)
+{
+    if (ctx->text_events)
+    {
+        fprintf(ctx->out, "log %04x %02x %02x %02x %04x %02x %02x\n",
+               event->pc, event->a, event->x, event->y,
+               event->next_pc, event->sp, event->flags);
+        return;
+    }
+    write_event(ctx, EVENT_LOG, event, sizeof(r_log_event));
 }
 
-void write8(uint16_t address, uint8_t value)
+void dump_log(r_context* ctx)
 {
-    ram[address] = value;
+    if (!ctx->log_ring)
+        return;
+    if (ctx->log_ring_full)
+        for (uint32_t i = ctx->log_ring_position; i < ctx->log_ring_size; i++)
+            emit_log(ctx, &ctx->log_ring[i]);
+    for (uint32_t i = 0; i < ctx->log_ring_position; i++)
+        emit_log(ctx, &ctx->log_ring[i]);
+    fflush(ctx->out);
+}
+
+// every run dumps its log once per request
+void request_log_dump(int signal)
+{
+    log_dump_requests++;
+}
+
+// SIGINT ends all runs, which still write their profile
+volatile sig_atomic_t stop_requested = 0;
+
+void request_stop(int signal)
+{
+    stop_requested = 1;
 }
 
-void push(uint8_t value)
+void emit_error(r_context* ctx, const char* format, ...)
 {
-    if (cpu.sp == 0)
+    char message[256];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+    dump_log(ctx);
+    if (ctx->text_events)
+        fprintf(ctx->out, "error %04x %s\n", ctx->old_pc, message);
+    else
     {
-        printf("error %04x Stack overflow\n", old_pc);
-        fflush(stdout);
+        write_event_header(ctx, EVENT_ERROR, sizeof(uint16_t) + strlen(message));
+        fwrite(&ctx->old_pc, sizeof(uint16_t), 1, ctx->out);
+        fwrite(message, strlen(message), 1, ctx->out);
+    }
+    fflush(ctx->out);
+}
 
-        fprintf(stderr, "Stack overflow!\n");
-        exit(1);
+void emit_call(r_context* ctx, uint16_t pc, uint64_t call_cycles)
+{
+    if (ctx->text_events)
+    {
+        fprintf(ctx->out, "call 0x%04x %" PRIu64 " %" PRIu64 "\n", pc, ctx->cpu.total_cycles, call_cycles);
+        fflush(ctx->out);
+        return;
     }
-    ram[(uint16_t)cpu.sp + 0x100] = value;
-    cpu.sp--;
+    r_call_event event;
+    event.pc = pc;
+    event.cycles = ctx->cpu.total_cycles;
+    event.call_cycles = call_cycles;
+    write_event(ctx, EVENT_CALL, &event, sizeof(event));
 }
 
-uint8_t pop()
+void emit_write_watch(r_context* ctx, uint16_t address)
 {
-    if (cpu.sp == 0xff)
+    if (ctx->text_events)
     {
-        printf("error %04x Stack underrun\n", old_pc);
-        fflush(stdout);
-        fprintf(stderr, "Stack underrun!\n");
+        fprintf(ctx->out, "write 0x%04x 0x%02x 0x%04x %" PRIu64 "\n",
+                address, ctx->ram[address], ctx->old_pc, ctx->cpu.total_cycles);
+        fflush(ctx->out);
+        return;
+    }
+    r_write_watch_event event;
+    event.address = address;
+    event.value = ctx->ram[address];
+    event.pc = ctx->old_pc;
+    event.cycles = ctx->cpu.total_cycles;
+    write_event(ctx, EVENT_WRITE_WATCH, &event, sizeof(event));
+}
+
+void emit_watch(r_context* ctx, r_watch_event* event)
+{
+    if (ctx->text_events)
+    {
+        fprintf(ctx->out, "watch 0x%04x %d %" PRIu64, event->subroutine, event->index, event->cycles);
+        for (int i = 0; i < event->value_count; i++)
+            fprintf(ctx->out, " %d", event->values[i]);
+        fprintf(ctx->out, "\n");
+        fflush(ctx->out);
+        return;
+    }
+    write_event(ctx, EVENT_WATCH, event, sizeof(r_watch_event));
+}
+
+void collect_screen_changes(r_context* ctx, uint8_t current_screen, r_screen_changes* changes)
+{
+    // offsets into the bitmaps, relative to $2000
+    uint16_t shown = (current_screen == 1) ? 0 : 0x2000;
+    uint16_t hidden = 0x2000 - shown;
+    memset(changes, 0, sizeof(*changes));
+    for (int y = 0; y < 192; y++)
+    {
+        for (int x = 0; x < 40; x++)
+        {
+            uint16_t offset = shown + yoffset[y] + x;
+            uint8_t mask = 1 << (offset & 7);
+            uint8_t written = ctx->screen_written[offset >> 3] & mask;
+            if (written)
+                changes->redrawn++;
+            if (written || (ctx->screen_stale[offset >> 3] & mask))
+            {
+                changes->rows[y >> 3] |= 1 << (y & 7);
+                changes->bytes[(y * 40 + x) >> 3] |= 1 << ((y * 40 + x) & 7);
+            }
+        }
+    }
+    // the hidden page now differs from this screen wherever either page
+    // differed from the previous screen
+    for (int i = 0; i < 0x2000 / 8; i++)
+    {
+        ctx->screen_stale[(hidden >> 3) + i] |= ctx->screen_written[(hidden >> 3) + i] |
+            ctx->screen_stale[(shown >> 3) + i] | ctx->screen_written[(shown >> 3) + i];
+        ctx->screen_stale[(shown >> 3) + i] = 0;
+    }
+    memset(ctx->screen_written, 0, sizeof(ctx->screen_written));
+}
+
+/*
+ * Screen data is 40 bytes for each of the 192 lines, or null with
+ * --no-screen. redrawn is only counted if screens get shown or recorded.
+ */
+void emit_screen(r_context* ctx, uint8_t* screen, uint16_t redrawn)
+{
+    if (ctx->text_events)
+    {
+        fprintf(ctx->out, "screen %" PRIu64 " %d", ctx->cpu.total_cycles, redrawn);
+        if (screen)
+            for (int i = 0; i < 40 * 192; i++)
+                fprintf(ctx->out, " %d", screen[i]);
+        fprintf(ctx->out, "\n");
+        fflush(ctx->out);
+        return;
+    }
+    write_event_header(ctx, EVENT_SCREEN, sizeof(uint64_t) + sizeof(uint16_t) + (screen ? 40 * 192 : 0));
+    fwrite(&ctx->cpu.total_cycles, sizeof(uint64_t), 1, ctx->out);
+    fwrite(&redrawn, sizeof(uint16_t), 1, ctx->out);
+    if (screen)
+        fwrite(screen, 40 * 192, 1, ctx->out);
+}
+
+/*
+ * With --frames, screens also get written as input for pgif (280 192 2):
+ * the palette, then for every frame an 'h' command with the raw screen
+ * data. Every frame but the first is preceded by a 'c' command with its
+ * changes, and by a 'd' command if its delay differs from the last one.
+ */
+void emit_frame(r_context* ctx, uint8_t* screen, r_screen_changes* changes, uint16_t delay)
+{
+    if (ctx->recorded_frames == 0)
+        fprintf(ctx->frames, "000000\nffffff\n");
+    else
+    {
+        fprintf(ctx->frames, "c\n");
+        fwrite(changes->rows, sizeof(changes->rows), 1, ctx->frames);
+        fwrite(changes->bytes, sizeof(changes->bytes), 1, ctx->frames);
+    }
+    if (delay != ctx->frames_delay)
+    {
+        fprintf(ctx->frames, "d %d\n", delay);
+        ctx->frames_delay = delay;
+    }
+    fprintf(ctx->frames, "h\n");
+    fwrite(screen, 40 * 192, 1, ctx->frames);
+}
+
+/*
+ * With --gif, screens get encoded to an animated GIF on a separate thread.
+ * The emulator hands them over through a lock-free single producer, single
+ * consumer ring buffer and only has to wait if the encoder falls
+ * GIF_QUEUE_SIZE frames behind.
+ */
+#define GIF_QUEUE_SIZE 64
+
+typedef struct {
+    uint8_t screen[40 * 192];
+    r_screen_changes changes;
+    uint16_t delay;
+} r_gif_frame;
+
+typedef struct r_gif_encoder {
+    FILE* out;
+    pthread_t thread;
+    atomic_uint head; // next frame to encode, advanced by the encoder
+    atomic_uint tail; // next free slot, advanced by the emulator
+    atomic_int finished;
+    r_gif_frame frames[GIF_QUEUE_SIZE];
+} r_gif_encoder;
+
+void* gif_encoder_thread(void* arg)
+{
+    r_gif_encoder* gif = arg;
+    static const uint8_t palette[] = {0x00, 0x00, 0x00, 0xff, 0xff, 0xff};
+    uint8_t* pixels = malloc(280 * 192);
+    uint8_t* previous_pixels = malloc(280 * 192);
+    if (!pixels || !previous_pixels)
+    {
+        fprintf(stderr, "Error allocating buffer for image.\n");
         exit(1);
     }
-    cpu.sp++;
-    return ram[(uint16_t)cpu.sp + 0x100];
+    uint8_t have_previous_pixels = 0;
+    write_gif_header(gif->out, 280, 192, 2, palette);
+    while (1)
+    {
+        unsigned int head = atomic_load_explicit(&gif->head, memory_order_relaxed);
+        if (head == atomic_load_explicit(&gif->tail, memory_order_acquire))
+        {
+            // the last frame has been queued before finished got set
+            if (atomic_load_explicit(&gif->finished, memory_order_acquire) &&
+                head == atomic_load_explicit(&gif->tail, memory_order_acquire))
+                break;
+            usleep(1000);
+            continue;
+        }
+        r_gif_frame* frame = &gif->frames[head % GIF_QUEUE_SIZE];
+        uint16_t delay = frame->delay;
+        r_screen_changes changes = frame->changes;
+        uint8_t* p = pixels;
+        for (int y = 0; y < 192; y++)
+            for (int x = 0; x < 280; x++)
+                *(p++) = (frame->screen[y * 40 + x / 7] >> (x % 7)) & 1;
+        atomic_store_explicit(&gif->head, head + 1, memory_order_release);
+
+        struct gif_dirty_map dirty = {7, changes.rows, changes.bytes};
+        encode_image(gif->out, pixels, have_previous_pixels ? previous_pixels : 0, 280, 192, 2,
+                     delay, &dirty);
+        uint8_t* temp = previous_pixels;
+        previous_pixels = pixels;
+        pixels = temp;
+        have_previous_pixels = 1;
+    }
+    write_gif_trailer(gif->out);
+    fclose(gif->out);
+    free(previous_pixels);
+    free(pixels);
+    return 0;
 }
 
-void set_flag(int which, int value)
+void start_gif_encoder(r_context* ctx)
 {
-    cpu.flags &= ~which;
-    if (value)
-        cpu.flags |= which;
+    r_gif_encoder* gif = calloc(1, sizeof(r_gif_encoder));
+    if (!gif)
+    {
+        fprintf(stderr, "Error allocating GIF encoder.\n");
+        exit(1);
+    }
+    gif->out = ctx->gif_file;
+    ctx->gif_file = 0;
+    if (pthread_create(&gif->thread, 0, gif_encoder_thread, gif) != 0)
+    {
+        fprintf(stderr, "Error creating thread.\n");
+        exit(1);
+    }
+    ctx->gif = gif;
 }
 
-void update_zero_and_negative_flags(uint8_t value)
+// waits until all queued frames have been written
+void finish_gif_encoder(r_context* ctx)
 {
-    set_flag(ZERO, value == 0);
-    set_flag(NEGATIVE, value & 0x80);
+    atomic_store_explicit(&ctx->gif->finished, 1, memory_order_release);
+    pthread_join(ctx->gif->thread, 0);
+    free(ctx->gif);
+    ctx->gif = 0;
 }
 
-uint8_t test_flag(int which)
+void queue_gif_frame(r_context* ctx, uint8_t* screen, r_screen_changes* changes, uint16_t delay)
 {
-    return ((cpu.flags & which) == 0) ? 0 : 1;
+    r_gif_encoder* gif = ctx->gif;
+    unsigned int tail = atomic_load_explicit(&gif->tail, memory_order_relaxed);
+    while (tail - atomic_load_explicit(&gif->head, memory_order_acquire) >= GIF_QUEUE_SIZE)
+        usleep(100);
+    r_gif_frame* frame = &gif->frames[tail % GIF_QUEUE_SIZE];
+    memcpy(frame->screen, screen, 40 * 192);
+    frame->changes = *changes;
+    frame->delay = delay;
+    atomic_store_explicit(&gif->tail, tail + 1, memory_order_release);
 }
 
-void cmp(uint8_t a, uint8_t b)
+/*
+ * Recorded screens (--frames, --gif) are held back until a different
+ * screen comes along, so that every frame gets shown for exactly the time
+ * until the next different screen. Screens which didn't change just extend
+ * the delay of the previous frame.
+ */
+void flush_pending_screen(r_context* ctx)
 {
-    set_flag(CARRY, a >= b);
-    set_flag(ZERO, a == b);
-    set_flag(NEGATIVE, (a - b) & 0x80);
+    if (!ctx->has_pending_screen)
+        return;
+    // a run which stops right at a screen (--max-frames) leaves no time for
+    // the last frame, it keeps the delay of the previous one then
+    uint64_t delay = ctx->recorded_delay;
+    if (ctx->cpu.total_cycles > ctx->pending_screen_cycles)
+        delay = (ctx->cpu.total_cycles - ctx->pending_screen_cycles) / 10000;
+    if (delay > 0xffff)
+        delay = 0xffff;
+    ctx->recorded_delay = delay;
+    if (ctx->frames)
+        emit_frame(ctx, ctx->pending_screen, &ctx->pending_screen_changes, delay);
+    if (ctx->gif)
+        queue_gif_frame(ctx, ctx->pending_screen, &ctx->pending_screen_changes, delay);
+    ctx->recorded_frames++;
+    ctx->has_pending_screen = 0;
 }
 
-uint8_t rol(uint8_t x)
+void record_screen(r_context* ctx, uint8_t* screen, r_screen_changes* changes)
 {
-    uint8_t old_carry = test_flag(CARRY);
-    set_flag(CARRY, x & 0x80);
-    x <<= 1;
-    if (old_carry)
-        x |= 1;
-    return x;
+    if (ctx->has_pending_screen)
+    {
+        // nothing written, or the same values written again
+        uint8_t unchanged = 1;
+        for (int i = 0; unchanged && i < sizeof(changes->rows); i++)
+            if (changes->rows[i])
+                unchanged = 0;
+        if (unchanged || memcmp(screen, ctx->pending_screen, sizeof(ctx->pending_screen)) == 0)
+            return;
+        flush_pending_screen(ctx);
+    }
+    // the changes relate to the previous screen, which looks like the last
+    // frame, even if it has been dropped
+    memcpy(ctx->pending_screen, screen, sizeof(ctx->pending_screen));
+    ctx->pending_screen_changes = *changes;
+    ctx->pending_screen_cycles = ctx->cpu.total_cycles;
+    ctx->has_pending_screen = 1;
 }
 
-uint8_t ror(uint8_t x)
+void emit_cycles(r_context* ctx, uint64_t cycles)
 {
-    uint8_t old_carry = test_flag(CARRY);
-    set_flag(CARRY, x & 1);
-    x >>= 1;
-    if (old_carry)
-        x |= 0x80;
-    return x;
+    if (ctx->text_events)
+    {
+        fprintf(ctx->out, "cycles %" PRIu64 "\n", cycles);
+        return;
+    }
+    write_event(ctx, EVENT_CYCLES, &cycles, sizeof(uint64_t));
 }
 
-void adc(uint8_t value)
+/*
+ * Profiling: every JSR pushes the called function onto the trace stack and
+ * every RTS which returns to the matching stack pointer pops it again.
+ * Exclusive cycles are accounted after every instruction (or block) to the
+ * function on top of the trace stack, inclusive cycles are accounted once
+ * per outermost activation when it returns, so recursion isn't counted
+ * twice.
+ */
+void grow_call_edges(r_context* ctx)
 {
-    uint16_t t16 = cpu.a + value + (test_flag(CARRY) ? 1 : 0);
-    cpu.a = t16 & 0xff;
-    set_flag(CARRY, t16 > 0xff);
-    update_zero_and_negative_flags(cpu.a);
-    set_flag(OVERFLOW, ((t16 ^ (uint16_t)cpu.a) & (t16 ^ (uint16_t)value) & 0x0080));
+    r_call_edge* old_edges = ctx->call_edges;
+    uint32_t old_capacity = ctx->call_edge_capacity;
+    ctx->call_edge_capacity = old_capacity ? old_capacity * 2 : INITIAL_CALL_EDGE_CAPACITY;
+    ctx->call_edges = calloc(ctx->call_edge_capacity, sizeof(r_call_edge));
+    if (!ctx->call_edges)
+    {
+        fprintf(stderr, "Error allocating call graph.\n");
+        exit(1);
+    }
+    ctx->call_edge_count = 0;
+    for (uint32_t i = 0; i < old_capacity; i++)
+    {
+        if (old_edges[i].count == 0)
+            continue;
+        uint32_t mask = ctx->call_edge_capacity - 1;
+        uint32_t k = (old_edges[i].key * 0x9e3779b1u) >> 8;
+        while (ctx->call_edges[k & mask].count)
+            k++;
+        ctx->call_edges[k & mask] = old_edges[i];
+        ctx->call_edge_count++;
+    }
+    free(old_edges);
+}
 
-    if (test_flag(DECIMAL_MODE))
+void count_call_edge(r_context* ctx, uint16_t caller, uint16_t callee)
+{
+    if (ctx->call_edge_count * 4 >= ctx->call_edge_capacity * 3)
+        grow_call_edges(ctx);
+    uint32_t key = ((uint32_t)caller << 16) | callee;
+    uint32_t mask = ctx->call_edge_capacity - 1;
+    uint32_t k = (key * 0x9e3779b1u) >> 8;
+    while (1)
     {
-        set_flag(CARRY, 0);
-        if ((cpu.a & 0xf) > 0x9)
-            cpu.a += 0x06;
-        if ((cpu.a & 0xf0) > 0x90)
+        r_call_edge* edge = &ctx->call_edges[k & mask];
+        if (edge->count == 0)
+        {
+            edge->key = key;
+            edge->count = 1;
+            ctx->call_edge_count++;
+            return;
+        }
+        if (edge->key == key)
         {
-            cpu.a += 0x60;
-            set_flag(CARRY, 1);
+            edge->count++;
+            return;
         }
+        k++;
     }
 }
 
-void sbc(uint8_t value)
+void enter_function(r_context* ctx, uint16_t pc)
+{
+    uint16_t caller = ctx->start_pc;
+    if (ctx->trace_stack_pointer < 0xff)
+        caller = ctx->trace_stack_function[ctx->trace_stack_pointer + 1];
+    count_call_edge(ctx, caller, pc);
+    ctx->trace_stack_function[ctx->trace_stack_pointer] = pc;
+    ctx->trace_stack[ctx->trace_stack_pointer] = ctx->cpu.sp;
+    ctx->trace_stack_cycles[ctx->trace_stack_pointer] = ctx->cpu.total_cycles;
+    ctx->trace_stack_pointer--;
+    ctx->calls_per_function[pc]++;
+    ctx->active_calls_per_function[pc]++;
+}
+
+void leave_function(r_context* ctx)
 {
-    uint16_t t16 = cpu.a + ((uint16_t)value ^ 0xff) + (test_flag(CARRY) ? 1 : 0);
-    cpu.a = t16 & 0xff;
-    set_flag(CARRY, t16 > 0xff);
-    update_zero_and_negative_flags(cpu.a);
-    set_flag(OVERFLOW, ((t16 ^ (uint16_t)cpu.a) & (t16 ^ (uint16_t)value) & 0x0080));
-    if (test_flag(DECIMAL_MODE))
+    ctx->trace_stack_pointer++;
+    uint16_t pc = ctx->trace_stack_function[ctx->trace_stack_pointer];
+    uint64_t call_cycles = ctx->cpu.total_cycles - ctx->trace_stack_cycles[ctx->trace_stack_pointer];
+    if (--ctx->active_calls_per_function[pc] == 0)
+        ctx->inclusive_cycles_per_function[pc] += call_cycles;
+    if (ctx->call_events_for_function[pc])
+        emit_call(ctx, pc, call_cycles);
+}
+
+int compare_call_edges(const void* a, const void* b)
+{
+    uint32_t key_a = ((const r_call_edge*)a)->key;
+    uint32_t key_b = ((const r_call_edge*)b)->key;
+    return (key_a > key_b) - (key_a < key_b);
+}
+
+// a frame ends where the next one starts
+void record_frame_start(r_context* ctx)
+{
+    if (ctx->frame_started)
     {
-        set_flag(CARRY, 0);
-        cpu.a -= 0x66;
-        if ((cpu.a & 0xf) > 0x9)
-            cpu.a += 0x06;
-        if ((cpu.a & 0xf0) > 0x90)
+        if (ctx->frame_duration_count == ctx->frame_duration_capacity)
         {
-            cpu.a += 0x60;
-            set_flag(CARRY, 1);
+            uint32_t capacity = ctx->frame_duration_capacity ? ctx->frame_duration_capacity * 2 : 0x400;
+            uint32_t* durations = realloc(ctx->frame_durations, sizeof(uint32_t) * capacity);
+            if (!durations)
+            {
+                fprintf(stderr, "Error allocating frame durations.\n");
+                exit(1);
+            }
+            ctx->frame_durations = durations;
+            ctx->frame_duration_capacity = capacity;
         }
+        uint64_t duration = ctx->cpu.total_cycles - ctx->frame_start_cycles;
+        ctx->frame_durations[ctx->frame_duration_count++] = duration > UINT32_MAX ? UINT32_MAX : duration;
     }
+    ctx->frame_start_cycles = ctx->cpu.total_cycles;
+    ctx->frame_started = 1;
 }
 
-#define OPCODES \
-    _(ADC) _(AND) _(ASL) _(BCC) _(BCS) _(BEQ) _(BIT) _(BMI) _(BNE) _(BPL) _(BRK) _(BVC) \
-    _(BVS) _(CLC) _(CLD) _(CLI) _(CLV) _(CMP) _(CPX) _(CPY) _(DEC) _(DEX) _(DEY) _(EOR) \
-    _(INC) _(INX) _(INY) _(JMP) _(JSR) _(LDA) _(LDX) _(LDY) _(LSR) _(NOP) _(ORA) _(PHA) \
-    _(PHP) _(PLA) _(PLP) _(ROL) _(ROR) _(RTI) _(RTS) _(SBC) _(SEC) _(SED) _(SEI) _(STA) \
-    _(STX) _(STY) _(TAX) _(TAY) _(TSX) _(TXA) _(TXS) _(TYA) \
-    _(BRA) _(PHX) _(PHY) _(PLX) _(PLY) _(STZ) _(TRB) _(TSB) _(DEA) _(INA)
-
-#define _(x) x,
-typedef enum
+int compare_frame_durations(const void* a, const void* b)
 {
-    NO_OPCODE = -1,
-    OPCODES
-} r_opcode;
-#undef _
-
-#define _(x) #x,
-const char* const OPCODE_STRINGS[] = { OPCODES };
-#undef _
+    uint32_t da = *(const uint32_t*)a;
+    uint32_t db = *(const uint32_t*)b;
+    return (da > db) - (da < db);
+}
 
-#define ADDRESSING_MODES \
-    _(accumulator) \
-    _(immediate) \
-    _(implied) \
-    _(relative) \
-    _(absolute) \
-    _(zero_page) \
-    _(zero_page_indirect) \
-    _(indirect) /* JMP only */ \
-    _(zero_page_x) \
-    _(zero_page_y) \
-    _(absolute_x) /* +1 for page overflow */ \
-    _(absolute_y) /* +1 for page overflow */ \
-    _(indexed_indirect_x) \
-    _(indirect_indexed_y) /* +1 for page overflow */
+// nearest rank
+uint64_t frame_duration_percentile(uint32_t* sorted, uint32_t count, uint32_t percent)
+{
+    uint32_t rank = ((uint64_t)count * percent + 99) / 100;
+    return sorted[rank > 0 ? rank - 1 : 0];
+}
 
-#define _(x) x,
-typedef enum
+void emit_frame_stats(r_context* ctx)
 {
-    NO_ADDRESSING_MODE = -1,
-    ADDRESSING_MODES
-} r_addressing_mode;
-#undef _
+    uint32_t count = ctx->frame_duration_count;
+    if (count == 0)
+        return;
+    uint32_t* sorted = malloc(sizeof(uint32_t) * count);
+    if (!sorted)
+    {
+        fprintf(stderr, "Error allocating frame durations.\n");
+        exit(1);
+    }
+    memcpy(sorted, ctx->frame_durations, sizeof(uint32_t) * count);
+    qsort(sorted, count, sizeof(uint32_t), compare_frame_durations);
 
-#define _(x) #x,
-const char* const ADDRESSING_MODE_STRINGS[] = { ADDRESSING_MODES };
-#undef _
+    r_frame_stats_event event;
+    memset(&event, 0, sizeof(event));
+    event.mode = (ctx->start_frame_pc != 0xffff);
+    event.count = count;
+    event.min = sorted[0];
+    event.max = sorted[count - 1];
+    uint64_t sum = 0;
+    for (uint32_t i = 0; i < count; i++)
+        sum += sorted[i];
+    event.mean = sum / count;
+    event.p50 = frame_duration_percentile(sorted, count, 50);
+    event.p95 = frame_duration_percentile(sorted, count, 95);
+    event.p99 = frame_duration_percentile(sorted, count, 99);
+    event.bin_width = (event.max - event.min) / FRAME_HISTOGRAM_BINS + 1;
+    for (uint32_t i = 0; i < count; i++)
+        event.histogram[(sorted[i] - event.min) / event.bin_width]++;
+    free(sorted);
 
-#define TEST_OPCODE(opcode) test_opcode = opcode;
-#define OPCODE_VARIANT(opcode, cycles, addressing_mode) \
-    if (opcode_from_pc == opcode) { \
-        *_opcode = test_opcode; \
-        *_addressing_mode = addressing_mode; \
-        *_cycles = cycles; \
+    if (ctx->text_events)
+    {
+        fprintf(ctx->out, "frames %d %d %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64
+                " %" PRIu64 " %" PRIu64 " %" PRIu64, event.mode, event.count, event.min,
+                event.max, event.mean, event.p50, event.p95, event.p99, event.bin_width);
+        for (int i = 0; i < FRAME_HISTOGRAM_BINS; i++)
+            fprintf(ctx->out, " %d", event.histogram[i]);
+        fprintf(ctx->out, "\n");
     }
+    else
+        write_event(ctx, EVENT_FRAME_STATS, &event, sizeof(event));
+}
 
-void fetch_next_opcode(uint8_t* _read_opcode, r_opcode* _opcode, r_addressing_mode* _addressing_mode, uint8_t* _cycles)
+void emit_heat_map(r_context* ctx)
 {
-    /*
-     * The following data has been transcribed from
-     * https://www.atarimax.com/jindroush.atari.org/aopc.html
+    static const char* const kinds[HEAT_MAP_KINDS] = { "read", "write", "fetch" };
+    for (int kind = 0; kind < HEAT_MAP_KINDS; kind++)
+    {
+        for (int page = 0; page < 0x100; page++)
+        {
+            uint64_t* counts = ctx->heat_map + kind * 0x10000 + page * 0x100;
+            int used = 0;
+            for (int i = 0; i < 0x100 && !used; i++)
+                used = counts[i] != 0;
+            if (!used)
+                continue;
+            if (ctx->text_events)
+            {
+                fprintf(ctx->out, "heat %s 0x%02x", kinds[kind], page);
+                for (int i = 0; i < 0x100; i++)
+                    fprintf(ctx->out, " %" PRIu64, counts[i]);
+                fprintf(ctx->out, "\n");
+                continue;
+            }
+            r_heat_map_event event;
+            event.kind = kind;
+            event.page = page;
+            memcpy(event.counts, counts, sizeof(event.counts));
+            write_event(ctx, EVENT_HEAT_MAP, &event, sizeof(event));
+        }
+    }
+}
+
+void emit_pc_cycles(r_context* ctx)
+{
+    for (uint32_t pc = 0; pc < 0x10000; pc++)
+    {
+        r_pc_cycles* entry = &ctx->pc_cycles[pc];
+        if (entry->count == 0)
+            continue;
+        r_pc_cycles_event event;
+        event.pc = pc;
+        event.count = entry->count;
+        event.base_cycles = entry->base_cycles;
+        event.page_crossing_cycles = entry->page_crossing_cycles;
+        event.branch_taken_cycles = entry->branch_taken_cycles;
+        event.branch_page_crossing_cycles = entry->branch_page_crossing_cycles;
+        if (ctx->text_events)
+            fprintf(ctx->out, "pc_cycles 0x%04x %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64 "\n",
+                    event.pc, event.count, event.base_cycles, event.page_crossing_cycles,
+                    event.branch_taken_cycles, event.branch_page_crossing_cycles);
+        else
+            write_event(ctx, EVENT_PC_CYCLES, &event, sizeof(event));
+    }
+}
+
+// writes the exact cycle count and the profile, functions which are still
+// running count up to now
+void emit_profile(r_context* ctx)
+{
+    emit_cycles(ctx, ctx->cpu.total_cycles);
+    for (int i = 0xff; i > ctx->trace_stack_pointer; i--)
+    {
+        uint16_t pc = ctx->trace_stack_function[i];
+        if (ctx->active_calls_per_function[pc] == 0)
+            continue;
+        ctx->active_calls_per_function[pc] = 0;
+        ctx->inclusive_cycles_per_function[pc] += ctx->cpu.total_cycles - ctx->trace_stack_cycles[i];
+    }
+
+    for (uint32_t pc = 0; pc < 0x10000; pc++)
+    {
+        if (ctx->calls_per_function[pc] == 0)
+            continue;
+        r_function_event event;
+        event.pc = pc;
+        event.calls = ctx->calls_per_function[pc];
+        event.exclusive_cycles = ctx->cycles_per_function[pc];
+        event.inclusive_cycles = ctx->inclusive_cycles_per_function[pc];
+        if (ctx->text_events)
+            fprintf(ctx->out, "function 0x%04x %" PRIu64 " %" PRIu64 " %" PRIu64 "\n",
+                    event.pc, event.calls, event.exclusive_cycles, event.inclusive_cycles);
+        else
+            write_event(ctx, EVENT_FUNCTION, &event, sizeof(event));
+    }
+
+    uint32_t edge_count = 0;
+    r_call_edge* edges = malloc(sizeof(r_call_edge) * (ctx->call_edge_count + 1));
+    if (!edges)
+    {
+        fprintf(stderr, "Error allocating call graph.\n");
+        exit(1);
+    }
+    for (uint32_t i = 0; i < ctx->call_edge_capacity; i++)
+        if (ctx->call_edges[i].count)
+            edges[edge_count++] = ctx->call_edges[i];
+    qsort(edges, edge_count, sizeof(r_call_edge), compare_call_edges);
+    for (uint32_t i = 0; i < edge_count; i++)
+    {
+        r_call_edge_event event;
+        event.caller = edges[i].key >> 16;
+        event.callee = edges[i].key & 0xffff;
+        event.count = edges[i].count;
+        if (ctx->text_events)
+            fprintf(ctx->out, "edge 0x%04x 0x%04x %" PRIu64 "\n", event.caller, event.callee, event.count);
+        else
+            write_event(ctx, EVENT_CALL_EDGE, &event, sizeof(event));
+    }
+    free(edges);
+    emit_frame_stats(ctx);
+    if (ctx->heat_map)
+        emit_heat_map(ctx);
+    if (ctx->pc_cycles)
+        emit_pc_cycles(ctx);
+    fflush(ctx->out);
+}
+
+uint8_t rpc8(r_context* ctx)
+{
+    return ctx->ram[ctx->cpu.pc++];
+}
+
+uint16_t rpc16(r_context* ctx)
+{
+    uint16_t result = rpc8(ctx);
+    result |= ((uint16_t)rpc8(ctx)) << 8;
+    return result;
+}
+
+uint8_t read8(r_context* ctx, uint16_t address)
+{
+    if (ctx->heat_map)
+        ctx->heat_map[HEAT_MAP_READS * 0x10000 + address]++;
+    r_read_handler handler = ctx->read_handlers[address >> 8];
+    if (handler)
+        return handler(ctx, address);
+    return ctx->ram[address];
+}
+
+uint16_t read16(r_context* ctx, uint16_t address)
+{
+    uint16_t result = read8(ctx, address);
+    result |= ((uint16_t)read8(ctx, address + 1)) << 8;
+    return result;
+}
+
+// reads memory without calling any I/O handler
+uint16_t peek16(r_context* ctx, uint16_t address)
+{
+    return ctx->ram[address] | ((uint16_t)ctx->ram[(uint16_t)(address + 1)] << 8);
+}
+
+// data reads of an instruction, without io they skip the read handlers
+static ALWAYS_INLINE uint8_t read_data(r_context* ctx, uint8_t io, uint16_t address)
+{
+    if (io)
+        return read8(ctx, address);
+    return ctx->ram[address];
+}
+
+static ALWAYS_INLINE uint16_t read_data16(r_context* ctx, uint8_t io, uint16_t address)
+{
+    if (io)
+        return read16(ctx, address);
+    return peek16(ctx, address);
+}
+
+void flush_block_cache(r_context* ctx)
+{
+    ctx->block_pool_used = 0;
+    memset(ctx->block_for_pc, 0, sizeof(ctx->block_for_pc));
+    memset(ctx->blocks_for_page, 0, sizeof(ctx->blocks_for_page));
+    for (int i = 0; i < 0x100; i++)
+        ctx->write_page_flags[i] &= ~WRITE_FLAG_CODE;
+#ifdef JIT
+    ctx->jit_buffer_used = 0;
+    ctx->jit_flush_requested = 0;
+#endif
+}
+
+void invalidate_code_page(r_context* ctx, uint8_t page)
+{
+    // blocks are shorter than a page, so only blocks starting in this
+    // or the previous page can touch this page
+    for (int k = 0; k < 2; k++)
+    {
+        r_block** link = &ctx->blocks_for_page[(uint8_t)(page - k)];
+        while (*link)
+        {
+            r_block* block = *link;
+            if (k == 0 || ((uint16_t)(block->end_pc - 1) >> 8) == page)
+            {
+                ctx->block_for_pc[block->start_pc] = 0;
+                *link = block->next_in_page;
+            }
+            else
+                link = &block->next_in_page;
+        }
+    }
+    ctx->write_page_flags[page] &= ~WRITE_FLAG_CODE;
+    if (ctx->page_invalidations[page] < MAX_PAGE_INVALIDATIONS)
+        ctx->page_invalidations[page]++;
+    ctx->block_exit = 1;
+}
+
+void record_write(r_context* ctx, uint16_t address)
+{
+    if (ctx->write_log_count == ctx->write_log_capacity)
+    {
+        uint32_t capacity = ctx->write_log_capacity ? ctx->write_log_capacity * 2 : 0x40;
+        r_memory_write* write_log = realloc(ctx->write_log, sizeof(r_memory_write) * capacity);
+        if (!write_log)
+        {
+            fprintf(stderr, "Error allocating write log.\n");
+            exit(1);
+        }
+        ctx->write_log = write_log;
+        ctx->write_log_capacity = capacity;
+    }
+    r_memory_write* write = &ctx->write_log[ctx->write_log_count++];
+    write->address = address;
+    write->value = ctx->ram[address];
+}
+
+void handle_flagged_write(r_context* ctx, uint16_t address)
+{
+    uint8_t page = address >> 8;
+    if ((ctx->write_page_flags[page] & WRITE_FLAG_SCREEN_SWITCH) && address == 0x30b)
+        ctx->block_exit = 1;
+    if (ctx->write_page_flags[page] & WRITE_FLAG_CODE)
+        invalidate_code_page(ctx, page);
+    if (ctx->write_page_flags[page] & WRITE_FLAG_SCREEN)
+        ctx->screen_written[(address - 0x2000) >> 3] |= 1 << (address & 7);
+    if (ctx->write_page_flags[page] & WRITE_FLAG_LOG)
+        record_write(ctx, address);
+    if (ctx->write_page_flags[page] & WRITE_FLAG_IO)
+        ctx->write_handlers[page](ctx, address, ctx->ram[address]);
+    if ((ctx->write_page_flags[page] & WRITE_FLAG_WATCH) &&
+        (ctx->write_watched[address >> 3] & (1 << (address & 7))))
+        emit_write_watch(ctx, address);
+    if (ctx->write_page_flags[page] & WRITE_FLAG_HEAT_MAP)
+        ctx->heat_map[HEAT_MAP_WRITES * 0x10000 + address]++;
+}
+
+void write8(r_context* ctx, uint16_t address, uint8_t value)
+{
+    ctx->ram[address] = value;
+    if (ctx->write_page_flags[address >> 8])
+        handle_flagged_write(ctx, address);
+}
+
+// hooks a page, either handler may be 0
+void register_io_page(r_context* ctx, uint8_t page, r_read_handler read, r_write_handler write)
+{
+    if (read && !ctx->read_handlers[page])
+        ctx->read_handler_count++;
+    ctx->read_handlers[page] = read;
+    ctx->write_handlers[page] = write;
+    if (write)
+        ctx->write_page_flags[page] |= WRITE_FLAG_IO;
+}
+
+/*
+ * --soft-switches: the Apple II keyboard. $C000 holds the current key with
+ * bit 7 set until any access to $C010 clears the strobe and moves on to
+ * the next key of --keys. Once all keys have been typed, $C000 keeps
+ * returning the last one, without bit 7. All other soft switches read 0
+ * and have no effect.
+ */
+uint8_t access_soft_switch(r_context* ctx, uint16_t address)
+{
+    size_t length = ctx->key_count;
+    if (address < 0xc010)
+    {
+        if (ctx->key_position < length)
+        {
+            char key = ctx->keys[ctx->key_position];
+            return (key == '\n' ? 0x0d : key) | 0x80;
+        }
+        if (length > 0)
+        {
+            char key = ctx->keys[length - 1];
+            return key == '\n' ? 0x0d : key & 0x7f;
+        }
+        return 0;
+    }
+    if (address < 0xc020 && ctx->key_position < length)
+        ctx->key_position++;
+    return 0;
+}
+
+uint8_t read_io(r_context* ctx, uint16_t address)
+{
+    if (ctx->io_value_set[address >> 3] & (1 << (address & 7)))
+        return ctx->io_value_for_address[address];
+    if (ctx->soft_switches && (address >> 8) == 0xc0)
+        return access_soft_switch(ctx, address);
+    return ctx->ram[address];
+}
+
+// write8() has already stored the value, only the strobe is left to do
+void write_io(r_context* ctx, uint16_t address, uint8_t value)
+{
+    (void)value;
+    if (ctx->soft_switches && (address >> 8) == 0xc0)
+        access_soft_switch(ctx, address);
+}
+
+void register_io_pages(r_context* ctx)
+{
+    if (ctx->soft_switches)
+        register_io_page(ctx, 0xc0, read_io, write_io);
+    for (uint32_t i = 0; i < ctx->io_value_count; i++)
+    {
+        uint16_t address = ctx->io_values[i].address;
+        ctx->io_value_set[address >> 3] |= 1 << (address & 7);
+        ctx->io_value_for_address[address] = ctx->io_values[i].value;
+        register_io_page(ctx, address >> 8, read_io, write_io);
+    }
+}
+
+void push(r_context* ctx, uint8_t value)
+{
+    if (ctx->cpu.sp == 0)
+    {
+        emit_error(ctx, "Stack overflow");
+        fprintf(stderr, "Stack overflow!\n");
+        stop_run(ctx);
+    }
+    write8(ctx, (uint16_t)ctx->cpu.sp + 0x100, value);
+    ctx->cpu.sp--;
+}
+
+uint8_t pop(r_context* ctx)
+{
+    if (ctx->cpu.sp == 0xff)
+    {
+        emit_error(ctx, "Stack underrun");
+        fprintf(stderr, "Stack underrun!\n");
+        stop_run(ctx);
+    }
+    ctx->cpu.sp++;
+    uint16_t address = (uint16_t)ctx->cpu.sp + 0x100;
+    if (ctx->heat_map)
+        ctx->heat_map[HEAT_MAP_READS * 0x10000 + address]++;
+    return ctx->ram[address];
+}
+
+// for the eagerly evaluated flags only (interrupt disable, decimal mode
+// and overflow), carry, zero and negative are kept in their own fields
+void set_flag(r_context* ctx, int which, int value)
+{
+    ctx->cpu.flags &= ~which;
+    if (value)
+        ctx->cpu.flags |= which;
+}
+
+uint8_t test_flag(r_context* ctx, int which)
+{
+    return ((ctx->cpu.flags & which) == 0) ? 0 : 1;
+}
+
+void set_carry(r_context* ctx, int value)
+{
+    ctx->cpu.carry = value ? 1 : 0;
+}
+
+void update_zero_and_negative_flags(r_context* ctx, uint8_t value)
+{
+    ctx->cpu.zero_result = value;
+    ctx->cpu.negative_result = value;
+}
+
+void cmp(r_context* ctx, uint8_t a, uint8_t b)
+{
+    set_carry(ctx, a >= b);
+    update_zero_and_negative_flags(ctx, a - b);
+}
+
+uint8_t rol(r_context* ctx, uint8_t x)
+{
+    uint8_t old_carry = ctx->cpu.carry;
+    set_carry(ctx, x & 0x80);
+    x <<= 1;
+    if (old_carry)
+        x |= 1;
+    return x;
+}
+
+uint8_t ror(r_context* ctx, uint8_t x)
+{
+    uint8_t old_carry = ctx->cpu.carry;
+    set_carry(ctx, x & 1);
+    x >>= 1;
+    if (old_carry)
+        x |= 0x80;
+    return x;
+}
+
+void adc(r_context* ctx, uint8_t value)
+{
+    uint16_t t16 = ctx->cpu.a + value + ctx->cpu.carry;
+    ctx->cpu.a = t16 & 0xff;
+    set_carry(ctx, t16 > 0xff);
+    update_zero_and_negative_flags(ctx, ctx->cpu.a);
+    set_flag(ctx, OVERFLOW, ((t16 ^ (uint16_t)ctx->cpu.a) & (t16 ^ (uint16_t)value) & 0x0080));
+
+    if (test_flag(ctx, DECIMAL_MODE))
+    {
+        set_carry(ctx, 0);
+        if ((ctx->cpu.a & 0xf) > 0x9)
+            ctx->cpu.a += 0x06;
+        if ((ctx->cpu.a & 0xf0) > 0x90)
+        {
+            ctx->cpu.a += 0x60;
+            set_carry(ctx, 1);
+        }
+    }
+}
+
+void sbc(r_context* ctx, uint8_t value)
+{
+    uint16_t t16 = ctx->cpu.a + ((uint16_t)value ^ 0xff) + ctx->cpu.carry;
+    ctx->cpu.a = t16 & 0xff;
+    set_carry(ctx, t16 > 0xff);
+    update_zero_and_negative_flags(ctx, ctx->cpu.a);
+    set_flag(ctx, OVERFLOW, ((t16 ^ (uint16_t)ctx->cpu.a) & (t16 ^ (uint16_t)value) & 0x0080));
+    if (test_flag(ctx, DECIMAL_MODE))
+    {
+        set_carry(ctx, 0);
+        ctx->cpu.a -= 0x66;
+        if ((ctx->cpu.a & 0xf) > 0x9)
+            ctx->cpu.a += 0x06;
+        if ((ctx->cpu.a & 0xf0) > 0x90)
+        {
+            ctx->cpu.a += 0x60;
+            set_carry(ctx, 1);
+        }
+    }
+}
+
+#define OPCODES \
+    _(ADC) _(AND) _(ASL) _(BCC) _(BCS) _(BEQ) _(BIT) _(BMI) _(BNE) _(BPL) _(BRK) _(BVC) \
+    _(BVS) _(CLC) _(CLD) _(CLI) _(CLV) _(CMP) _(CPX) _(CPY) _(DEC) _(DEX) _(DEY) _(EOR) \
+    _(INC) _(INX) _(INY) _(JMP) _(JSR) _(LDA) _(LDX) _(LDY) _(LSR) _(NOP) _(ORA) _(PHA) \
+    _(PHP) _(PLA) _(PLP) _(ROL) _(ROR) _(RTI) _(RTS) _(SBC) _(SEC) _(SED) _(SEI) _(STA) \
+    _(STX) _(STY) _(TAX) _(TAY) _(TSX) _(TXA) _(TXS) _(TYA) \
+    _(BRA) _(PHX) _(PHY) _(PLX) _(PLY) _(STZ) _(TRB) _(TSB) _(DEA) _(INA)
+
+#define _(x) x,
+typedef enum
+{
+    NO_OPCODE = -1,
+    OPCODES
+} r_opcode;
+#undef _
+
+#define _(x) #x,
+const char* const OPCODE_STRINGS[] = { OPCODES };
+#undef _
+
+#define ADDRESSING_MODES \
+    _(accumulator) \
+    _(immediate) \
+    _(implied) \
+    _(relative) \
+    _(absolute) \
+    _(zero_page) \
+    _(zero_page_indirect) \
+    _(indirect) /* JMP only */ \
+    _(zero_page_x) \
+    _(zero_page_y) \
+    _(absolute_x) /* +1 for page overflow */ \
+    _(absolute_y) /* +1 for page overflow */ \
+    _(indexed_indirect_x) \
+    _(indirect_indexed_y) /* +1 for page overflow */
+
+#define _(x) x,
+typedef enum
+{
+    NO_ADDRESSING_MODE = -1,
+    ADDRESSING_MODES
+} r_addressing_mode;
+#undef _
+
+#define _(x) #x,
+const char* const ADDRESSING_MODE_STRINGS[] = { ADDRESSING_MODES };
+#undef _
+
+typedef struct {
+    r_opcode opcode;
+    r_addressing_mode addressing_mode;
+    uint8_t cycles;
+    uint8_t length;
+} r_opcode_entry;
+
+// decoded opcode, addressing mode, base cycles and instruction length
+// for every possible opcode byte
+r_opcode_entry opcode_table[0x100];
+
+uint8_t instruction_length(r_addressing_mode addressing_mode)
+{
+    switch (addressing_mode)
+    {
+        case immediate:
+        case relative:
+        case zero_page:
+        case zero_page_indirect:
+        case zero_page_x:
+        case zero_page_y:
+        case indexed_indirect_x:
+        case indirect_indexed_y:
+            return 2;
+        case absolute:
+        case indirect:
+        case absolute_x:
+        case absolute_y:
+            return 3;
+        default:
+            return 1;
+    }
+}
+
+#define TEST_OPCODE(opcode) test_opcode = opcode;
+#define OPCODE_VARIANT(_read_opcode, _cycles, _addressing_mode) \
+    opcode_table[_read_opcode].opcode = test_opcode; \
+    opcode_table[_read_opcode].addressing_mode = _addressing_mode; \
+    opcode_table[_read_opcode].cycles = _cycles; \
+    opcode_table[_read_opcode].length = instruction_length(_addressing_mode);
+
+void init_opcode_table()
+{
+    /*
+     * The following data has been transcribed from
+     * https://www.atarimax.com/jindroush.atari.org/aopc.html
      */
     r_opcode test_opcode = NO_OPCODE;
-    uint8_t opcode_from_pc = rpc8();
-    *_read_opcode = opcode_from_pc;
+    for (int i = 0; i < 0x100; i++)
+    {
+        opcode_table[i].opcode = NO_OPCODE;
+        opcode_table[i].addressing_mode = NO_ADDRESSING_MODE;
+        opcode_table[i].cycles = 0;
+        opcode_table[i].length = 1;
+    }
 
     TEST_OPCODE(ADC)
         OPCODE_VARIANT(0x69, 2, immediate)
@@ -559,36 +1895,48 @@ void fetch_next_opcode(uint8_t* _read_opcode, r_opcode* _opcode, r_addressing_mo
         OPCODE_VARIANT(0x9E, 5, absolute_x)
 }
 
-void branch(uint8_t condition, int8_t offset, uint8_t* cycles)
+/*
+ * GCC and clang support computed gotos, which lets handle_next_opcode() jump
+ * straight to the handler of the decoded opcode. Compile with
+ * -DNO_THREADED_DISPATCH to fall back to a plain switch statement.
+ */
+#if defined(__GNUC__) && !defined(NO_THREADED_DISPATCH)
+#define THREADED_DISPATCH
+#define OPCODE_CASE(x) case x: handle_##x
+#else
+#define OPCODE_CASE(x) case x
+#endif
+
+void branch(r_context* ctx, uint8_t condition, int8_t offset, uint8_t* cycles)
 {
     if (condition)
     {
         // branch succeeds
         *cycles += 1;
-        if ((cpu.pc & 0xfff0) != ((cpu.pc + offset) & 0xfff0))
+        if ((ctx->cpu.pc & 0xff00) != ((ctx->cpu.pc + offset) & 0xff00))
             *cycles += 1;
-        cpu.pc += offset;
+        ctx->cpu.pc += offset;
     }
 }
 
-void handle_next_opcode()
+/*
+ * Executes a single instruction whose opcode and operand bytes have already
+ * been fetched, with old_pc pointing to the instruction and cpu.pc pointing
+ * right behind it. Data reads call the read handlers only if io is set.
+ * Returns the number of cycles spent.
+ */
+uint8_t execute_instruction(r_context* ctx, uint8_t io, uint8_t read_opcode, uint16_t operand)
 {
-    old_pc = cpu.pc;
-
-    // fetch opcode, addressing mode and cycles for next instruction
-    uint8_t read_opcode = 0;
-    r_opcode opcode = NO_OPCODE;
-    r_addressing_mode addressing_mode = NO_ADDRESSING_MODE;
-    uint8_t cycles = 0;
-    fetch_next_opcode(&read_opcode, &opcode, &addressing_mode, &cycles);
+    r_opcode_entry* entry = &opcode_table[read_opcode];
+    r_opcode opcode = entry->opcode;
+    r_addressing_mode addressing_mode = entry->addressing_mode;
+    uint8_t cycles = entry->cycles;
 
     if (opcode == NO_OPCODE || addressing_mode == NO_ADDRESSING_MODE)
     {
-        printf("error %04x Unhandled opcode: %02x\n", old_pc, read_opcode);
-        fflush(stdout);
-        
-        fprintf(stderr, "Unhandled opcode at %04x: %02x\n", old_pc, read_opcode);
-        exit(1);
+        emit_error(ctx, "Unhandled opcode: %02x", read_opcode);
+        fprintf(stderr, "Unhandled opcode at %04x: %02x\n", ctx->old_pc, read_opcode);
+        stop_run(ctx);
     }
 
     // handle addressing modes, store result in target_address
@@ -598,50 +1946,49 @@ void handle_next_opcode()
     switch (addressing_mode)
     {
         case immediate:
-            immediate_value = rpc8();
+            immediate_value = operand;
             break;
         case relative:
-            relative_offset = (int8_t)rpc8();
+            relative_offset = (int8_t)operand;
             break;
         case absolute:
-            target_address = rpc16();
+            target_address = operand;
             break;
         case zero_page:
-            target_address = rpc8();
+            target_address = operand;
             break;
         case indirect:
-            target_address = read16(rpc16());
+            target_address = read_data16(ctx, io, operand);
             break;
         case zero_page_indirect:
-            target_address = read16(rpc8());
+            target_address = read_data16(ctx, io, operand);
             break;
         case zero_page_x:
-            target_address = (rpc8() + cpu.x) & 0xff;
+            target_address = (operand + ctx->cpu.x) & 0xff;
             break;
         case zero_page_y:
-            target_address = (rpc8() + cpu.y) & 0xff;
+            target_address = (operand + ctx->cpu.y) & 0xff;
             break;
         case absolute_x:
-            target_address = rpc16();
-            if ((target_address >> 12) != ((target_address + cpu.x) >> 12))
+            target_address = operand;
+            if ((target_address >> 8) != ((target_address + ctx->cpu.x) >> 8))
                 cycles += 1;
-            target_address += cpu.x;
+            target_address += ctx->cpu.x;
             break;
         case absolute_y:
-            target_address = rpc16();
-            if ((target_address >> 12) != ((target_address + cpu.y) >> 12))
+            target_address = operand;
+            if ((target_address >> 8) != ((target_address + ctx->cpu.y) >> 8))
                 cycles += 1;
-            target_address += cpu.y;
+            target_address += ctx->cpu.y;
             break;
         case indexed_indirect_x:
-            target_address = read16((rpc8() + cpu.x) & 0xff);
+            target_address = read_data16(ctx, io, (operand + ctx->cpu.x) & 0xff);
             break;
         case indirect_indexed_y:
-            target_address = cpu.y;
-            uint16_t temp = read16(rpc8());
-            if ((target_address >> 12) != ((target_address + temp) >> 12))
+            target_address = read_data16(ctx, io, operand);
+            if ((target_address >> 8) != ((target_address + ctx->cpu.y) >> 8))
                 cycles += 1;
-            target_address += temp;
+            target_address += ctx->cpu.y;
             break;
     }
 
@@ -650,442 +1997,1572 @@ void handle_next_opcode()
     uint16_t t16 = 0;
 
     // handle opcode
+#ifdef THREADED_DISPATCH
+#define _(x) &&handle_##x,
+    static void* const OPCODE_HANDLERS[] = { OPCODES };
+#undef _
+    goto *OPCODE_HANDLERS[opcode];
+#endif
     switch (opcode)
     {
-        case ADC:
-            adc((addressing_mode == immediate) ? immediate_value : read8(target_address));
+        OPCODE_CASE(ADC):
+            adc(ctx, (addressing_mode == immediate) ? immediate_value : read_data(ctx, io, target_address));
             break;
-        case AND:
-            t8 = (addressing_mode == immediate) ? immediate_value : read8(target_address);
-            cpu.a &= t8;
-            update_zero_and_negative_flags(cpu.a);
+        OPCODE_CASE(AND):
+            t8 = (addressing_mode == immediate) ? immediate_value : read_data(ctx, io, target_address);
+            ctx->cpu.a &= t8;
+            update_zero_and_negative_flags(ctx, ctx->cpu.a);
             break;
-        case ASL:
+        OPCODE_CASE(ASL):
             if (addressing_mode == accumulator)
             {
-                set_flag(CARRY, cpu.a & 0x80);
-                cpu.a <<= 1;
-                update_zero_and_negative_flags(cpu.a);
+                set_carry(ctx, ctx->cpu.a & 0x80);
+                ctx->cpu.a <<= 1;
+                update_zero_and_negative_flags(ctx, ctx->cpu.a);
             }
             else
             {
-                t8 = read8(target_address);
-                set_flag(CARRY, t8 & 0x80);
+                t8 = read_data(ctx, io, target_address);
+                set_carry(ctx, t8 & 0x80);
                 t8 <<= 1;
-                update_zero_and_negative_flags(t8);
-                write8(target_address, t8);
+                update_zero_and_negative_flags(ctx, t8);
+                write8(ctx, target_address, t8);
             }
             break;
-        case BCC:
-            branch(!test_flag(CARRY), relative_offset, &cycles);
+        OPCODE_CASE(BCC):
+            branch(ctx, !ctx->cpu.carry, relative_offset, &cycles);
             break;
-        case BCS:
-            branch(test_flag(CARRY), relative_offset, &cycles);
+        OPCODE_CASE(BCS):
+            branch(ctx, ctx->cpu.carry, relative_offset, &cycles);
             break;
-        case BEQ:
-            branch(test_flag(ZERO), relative_offset, &cycles);
+        OPCODE_CASE(BEQ):
+            branch(ctx, ctx->cpu.zero_result == 0, relative_offset, &cycles);
             break;
-        case BIT:
-            t8 = read8(target_address);
-            uint8_t temp = cpu.a;
+        OPCODE_CASE(BIT):
+            t8 = read_data(ctx, io, target_address);
+            uint8_t temp = ctx->cpu.a;
             temp &= t8;
-            update_zero_and_negative_flags(temp);
-            set_flag(NEGATIVE, t8 & 0x80);
-            set_flag(OVERFLOW, t8 & 0x40);
+            ctx->cpu.zero_result = temp;
+            ctx->cpu.negative_result = t8;
+            set_flag(ctx, OVERFLOW, t8 & 0x40);
             break;
-        case BMI:
-            branch(test_flag(NEGATIVE), relative_offset, &cycles);
+        OPCODE_CASE(BMI):
+            branch(ctx, ctx->cpu.negative_result & NEGATIVE, relative_offset, &cycles);
             break;
-        case BNE:
-            branch(!test_flag(ZERO), relative_offset, &cycles);
+        OPCODE_CASE(BNE):
+            branch(ctx, ctx->cpu.zero_result != 0, relative_offset, &cycles);
             break;
-        case BPL:
-            branch(!test_flag(NEGATIVE), relative_offset, &cycles);
+        OPCODE_CASE(BPL):
+            branch(ctx, !(ctx->cpu.negative_result & NEGATIVE), relative_offset, &cycles);
             break;
-        case BRA:
-            branch(1, relative_offset, &cycles);
+        OPCODE_CASE(BRA):
+            branch(ctx, 1, relative_offset, &cycles);
             break;
-        case BRK:
-            brk_encountered = 1;
+        OPCODE_CASE(BRK):
+            ctx->brk_encountered = 1;
             break;
-        case BVC:
-            branch(!test_flag(OVERFLOW), relative_offset, &cycles);
+        OPCODE_CASE(BVC):
+            branch(ctx, !test_flag(ctx, OVERFLOW), relative_offset, &cycles);
             break;
-        case BVS:
-            branch(test_flag(OVERFLOW), relative_offset, &cycles);
+        OPCODE_CASE(BVS):
+            branch(ctx, test_flag(ctx, OVERFLOW), relative_offset, &cycles);
             break;
-        case CLC:
-            set_flag(CARRY, 0);
+        OPCODE_CASE(CLC):
+            set_carry(ctx, 0);
             break;
-        case CLD:
-            set_flag(DECIMAL_MODE, 0);
+        OPCODE_CASE(CLD):
+            set_flag(ctx, DECIMAL_MODE, 0);
             break;
-        case CLI:
+        OPCODE_CASE(CLI):
             // is this the right flag 0x04 ?
-            set_flag(INTERRUPT_DISABLE, 0);
+            set_flag(ctx, INTERRUPT_DISABLE, 0);
             break;
-        case CLV:
-            set_flag(OVERFLOW, 0);
+        OPCODE_CASE(CLV):
+            set_flag(ctx, OVERFLOW, 0);
             break;
-        case CMP:
-            t8 = (addressing_mode == immediate) ? immediate_value : read8(target_address);
-            cmp(cpu.a, t8);
+        OPCODE_CASE(CMP):
+            t8 = (addressing_mode == immediate) ? immediate_value : read_data(ctx, io, target_address);
+            cmp(ctx, ctx->cpu.a, t8);
             break;
-        case CPX:
-            t8 = (addressing_mode == immediate) ? immediate_value : read8(target_address);
-            cmp(cpu.x, t8);
+        OPCODE_CASE(CPX):
+            t8 = (addressing_mode == immediate) ? immediate_value : read_data(ctx, io, target_address);
+            cmp(ctx, ctx->cpu.x, t8);
             break;
-        case CPY:
-            t8 = (addressing_mode == immediate) ? immediate_value : read8(target_address);
-            cmp(cpu.y, t8);
+        OPCODE_CASE(CPY):
+            t8 = (addressing_mode == immediate) ? immediate_value : read_data(ctx, io, target_address);
+            cmp(ctx, ctx->cpu.y, t8);
             break;
-        case DEC:
-            t8 = read8(target_address);
+        OPCODE_CASE(DEC):
+            t8 = read_data(ctx, io, target_address);
             t8 -= 1;
-            write8(target_address, t8);
-            update_zero_and_negative_flags(t8);
+            write8(ctx, target_address, t8);
+            update_zero_and_negative_flags(ctx, t8);
             break;
-        case DEA:
-            cpu.a -= 1;
-            update_zero_and_negative_flags(cpu.a);
+        OPCODE_CASE(DEA):
+            ctx->cpu.a -= 1;
+            update_zero_and_negative_flags(ctx, ctx->cpu.a);
             break;
-        case DEX:
-            cpu.x -= 1;
-            update_zero_and_negative_flags(cpu.x);
+        OPCODE_CASE(DEX):
+            ctx->cpu.x -= 1;
+            update_zero_and_negative_flags(ctx, ctx->cpu.x);
             break;
-        case DEY:
-            cpu.y -= 1;
-            update_zero_and_negative_flags(cpu.y);
+        OPCODE_CASE(DEY):
+            ctx->cpu.y -= 1;
+            update_zero_and_negative_flags(ctx, ctx->cpu.y);
             break;
-        case EOR:
-            t8 = (addressing_mode == immediate) ? immediate_value : read8(target_address);
-            cpu.a ^= t8;
-            update_zero_and_negative_flags(cpu.a);
+        OPCODE_CASE(EOR):
+            t8 = (addressing_mode == immediate) ? immediate_value : read_data(ctx, io, target_address);
+            ctx->cpu.a ^= t8;
+            update_zero_and_negative_flags(ctx, ctx->cpu.a);
             break;
-        case INC:
-            t8 = read8(target_address);
+        OPCODE_CASE(INC):
+            t8 = read_data(ctx, io, target_address);
             t8 += 1;
-            write8(target_address, t8);
-            update_zero_and_negative_flags(t8);
+            write8(ctx, target_address, t8);
+            update_zero_and_negative_flags(ctx, t8);
             break;
-        case INA:
-            cpu.a += 1;
-            update_zero_and_negative_flags(cpu.a);
+        OPCODE_CASE(INA):
+            ctx->cpu.a += 1;
+            update_zero_and_negative_flags(ctx, ctx->cpu.a);
             break;
-        case INX:
-            cpu.x += 1;
-            update_zero_and_negative_flags(cpu.x);
+        OPCODE_CASE(INX):
+            ctx->cpu.x += 1;
+            update_zero_and_negative_flags(ctx, ctx->cpu.x);
             break;
-        case INY:
-            cpu.y += 1;
-            update_zero_and_negative_flags(cpu.y);
+        OPCODE_CASE(INY):
+            ctx->cpu.y += 1;
+            update_zero_and_negative_flags(ctx, ctx->cpu.y);
             break;
-        case JMP:
-            cpu.pc = target_address;
+        OPCODE_CASE(JMP):
+            ctx->cpu.pc = target_address;
             // TODO handle page boundary behaviour?
             break;
-        case JSR:
+        OPCODE_CASE(JSR):
+            enter_function(ctx, target_address);
             // push PC - 1 because target address has already been read
-            trace_stack_function[trace_stack_pointer] = target_address;
-            trace_stack[trace_stack_pointer] = cpu.sp;
-            trace_stack_pointer--;
-            calls_per_function[target_address]++;
-            printf("jsr 0x%04x %d\n", target_address, cpu.total_cycles);
-            fflush(stdout);
-
-            push(((cpu.pc - 1) >> 8) & 0xff);
-            push((cpu.pc - 1) & 0xff);
-            cpu.pc = target_address;
-            break;
-        case LDA:
-            cpu.a = (addressing_mode == immediate) ? immediate_value : read8(target_address);
-            update_zero_and_negative_flags(cpu.a);
-            break;
-        case LDX:
-            cpu.x = (addressing_mode == immediate) ? immediate_value : read8(target_address);
-            update_zero_and_negative_flags(cpu.x);
-            break;
-        case LDY:
-            cpu.y = (addressing_mode == immediate) ? immediate_value : read8(target_address);
-            update_zero_and_negative_flags(cpu.y);
-            break;
-        case LSR:
+            push(ctx, ((ctx->cpu.pc - 1) >> 8) & 0xff);
+            push(ctx, (ctx->cpu.pc - 1) & 0xff);
+            ctx->cpu.pc = target_address;
+            break;
+        OPCODE_CASE(LDA):
+            ctx->cpu.a = (addressing_mode == immediate) ? immediate_value : read_data(ctx, io, target_address);
+            update_zero_and_negative_flags(ctx, ctx->cpu.a);
+            break;
+        OPCODE_CASE(LDX):
+            ctx->cpu.x = (addressing_mode == immediate) ? immediate_value : read_data(ctx, io, target_address);
+            update_zero_and_negative_flags(ctx, ctx->cpu.x);
+            break;
+        OPCODE_CASE(LDY):
+            ctx->cpu.y = (addressing_mode == immediate) ? immediate_value : read_data(ctx, io, target_address);
+            update_zero_and_negative_flags(ctx, ctx->cpu.y);
+            break;
+        OPCODE_CASE(LSR):
             if (addressing_mode == accumulator)
             {
-                set_flag(CARRY, cpu.a & 1);
-                cpu.a >>= 1;
-                update_zero_and_negative_flags(cpu.a);
+                set_carry(ctx, ctx->cpu.a & 1);
+                ctx->cpu.a >>= 1;
+                update_zero_and_negative_flags(ctx, ctx->cpu.a);
             }
             else
             {
-                t8 = read8(target_address);
-                set_flag(CARRY, t8 & 1);
+                t8 = read_data(ctx, io, target_address);
+                set_carry(ctx, t8 & 1);
                 t8 >>= 1;
-                update_zero_and_negative_flags(t8);
-                write8(target_address, t8);
+                update_zero_and_negative_flags(ctx, t8);
+                write8(ctx, target_address, t8);
             }
             break;
-        case NOP:
+        OPCODE_CASE(NOP):
             break;
-        case ORA:
-            t8 = (addressing_mode == immediate) ? immediate_value : read8(target_address);
-            cpu.a |= t8;
-            update_zero_and_negative_flags(cpu.a);
+        OPCODE_CASE(ORA):
+            t8 = (addressing_mode == immediate) ? immediate_value : read_data(ctx, io, target_address);
+            ctx->cpu.a |= t8;
+            update_zero_and_negative_flags(ctx, ctx->cpu.a);
             break;
-        case PHA:
-            push(cpu.a);
+        OPCODE_CASE(PHA):
+            push(ctx, ctx->cpu.a);
             break;
-        case PHX:
-            push(cpu.x);
+        OPCODE_CASE(PHX):
+            push(ctx, ctx->cpu.x);
             break;
-        case PHY:
-            push(cpu.y);
+        OPCODE_CASE(PHY):
+            push(ctx, ctx->cpu.y);
             break;
-        case PHP:
-            push(cpu.flags);
+        OPCODE_CASE(PHP):
+            push(ctx, get_flags(ctx));
             break;
-        case PLA:
-            cpu.a = pop();
+        OPCODE_CASE(PLA):
+            ctx->cpu.a = pop(ctx);
             break;
-        case PLX:
-            cpu.x = pop();
+        OPCODE_CASE(PLX):
+            ctx->cpu.x = pop(ctx);
             break;
-        case PLY:
-            cpu.y = pop();
+        OPCODE_CASE(PLY):
+            ctx->cpu.y = pop(ctx);
             break;
-        case PLP:
-            pop(cpu.flags);
+        OPCODE_CASE(PLP):
+            set_flags(ctx, pop(ctx));
             break;
-        case ROL:
+        OPCODE_CASE(ROL):
             if (addressing_mode == accumulator)
             {
-                cpu.a = rol(cpu.a);
-                update_zero_and_negative_flags(cpu.a);
+                ctx->cpu.a = rol(ctx, ctx->cpu.a);
+                update_zero_and_negative_flags(ctx, ctx->cpu.a);
             }
             else
             {
-                t8 = rol(read8(target_address));
-                write8(target_address, t8);
-                update_zero_and_negative_flags(t8);
+                t8 = rol(ctx, read_data(ctx, io, target_address));
+                write8(ctx, target_address, t8);
+                update_zero_and_negative_flags(ctx, t8);
             }
             break;
-        case ROR:
+        OPCODE_CASE(ROR):
             if (addressing_mode == accumulator)
             {
-                cpu.a = ror(cpu.a);
-                update_zero_and_negative_flags(cpu.a);
+                ctx->cpu.a = ror(ctx, ctx->cpu.a);
+                update_zero_and_negative_flags(ctx, ctx->cpu.a);
             }
             else
             {
-                t8 = ror(read8(target_address));
-                write8(target_address, t8);
-                update_zero_and_negative_flags(t8);
+                t8 = ror(ctx, read_data(ctx, io, target_address));
+                write8(ctx, target_address, t8);
+                update_zero_and_negative_flags(ctx, t8);
             }
             break;
-        case RTI:
-            cpu.flags = pop();
-            t16 = pop();
-            t16 |= ((uint16_t)pop()) << 8;
-            cpu.pc = t16;
+        OPCODE_CASE(RTI):
+            set_flags(ctx, pop(ctx));
+            t16 = pop(ctx);
+            t16 |= ((uint16_t)pop(ctx)) << 8;
+            ctx->cpu.pc = t16;
             break;
-        case RTS:
-            if (trace_stack[trace_stack_pointer + 1] == cpu.sp + 2)
-            {
-                printf("rts %d\n", cpu.total_cycles);
-                fflush(stdout);
-                trace_stack_pointer++;
-            }
+        OPCODE_CASE(RTS):
+            if (ctx->trace_stack[ctx->trace_stack_pointer + 1] == ctx->cpu.sp + 2)
+                leave_function(ctx);
 
-            t16 = pop();
-            t16 |= ((uint16_t)pop()) << 8;
-            cpu.pc = t16 + 1;
+            t16 = pop(ctx);
+            t16 |= ((uint16_t)pop(ctx)) << 8;
+            ctx->cpu.pc = t16 + 1;
             break;
-        case SBC:
-            sbc((addressing_mode == immediate) ? immediate_value : read8(target_address));
+        OPCODE_CASE(SBC):
+            sbc(ctx, (addressing_mode == immediate) ? immediate_value : read_data(ctx, io, target_address));
             break;
-        case SEC:
-            set_flag(CARRY, 1);
+        OPCODE_CASE(SEC):
+            set_carry(ctx, 1);
             break;
-        case SED:
-            set_flag(DECIMAL_MODE, 1);
+        OPCODE_CASE(SED):
+            set_flag(ctx, DECIMAL_MODE, 1);
             break;
-        case SEI:
+        OPCODE_CASE(SEI):
             // is this the right flag 0x04 ?
-            set_flag(INTERRUPT_DISABLE, 1);
+            set_flag(ctx, INTERRUPT_DISABLE, 1);
             break;
-        case STA:
-            write8(target_address, cpu.a);
+        OPCODE_CASE(STA):
+            write8(ctx, target_address, ctx->cpu.a);
             break;
-        case STX:
-            write8(target_address, cpu.x);
+        OPCODE_CASE(STX):
+            write8(ctx, target_address, ctx->cpu.x);
             break;
-        case STY:
-            write8(target_address, cpu.y);
+        OPCODE_CASE(STY):
+            write8(ctx, target_address, ctx->cpu.y);
             break;
-        case STZ:
-            write8(target_address, 0);
+        OPCODE_CASE(STZ):
+            write8(ctx, target_address, 0);
             break;
-        case TAX:
-            cpu.x = cpu.a;
-            update_zero_and_negative_flags(cpu.x);
+        OPCODE_CASE(TAX):
+            ctx->cpu.x = ctx->cpu.a;
+            update_zero_and_negative_flags(ctx, ctx->cpu.x);
             break;
-        case TAY:
-            cpu.y = cpu.a;
-            update_zero_and_negative_flags(cpu.y);
+        OPCODE_CASE(TAY):
+            ctx->cpu.y = ctx->cpu.a;
+            update_zero_and_negative_flags(ctx, ctx->cpu.y);
             break;
-        case TSX:
-            cpu.x = cpu.sp;
+        OPCODE_CASE(TSX):
+            ctx->cpu.x = ctx->cpu.sp;
+            update_zero_and_negative_flags(ctx, ctx->cpu.x);
             break;
-        case TXA:
-            cpu.a = cpu.x;
-            update_zero_and_negative_flags(cpu.a);
+        OPCODE_CASE(TXA):
+            ctx->cpu.a = ctx->cpu.x;
+            update_zero_and_negative_flags(ctx, ctx->cpu.a);
             break;
-        case TXS:
-            cpu.sp = cpu.x;
+        OPCODE_CASE(TXS):
+            ctx->cpu.sp = ctx->cpu.x;
             break;
-        case TYA:
-            cpu.a = cpu.y;
-            update_zero_and_negative_flags(cpu.a);
+        OPCODE_CASE(TYA):
+            ctx->cpu.a = ctx->cpu.y;
+            update_zero_and_negative_flags(ctx, ctx->cpu.a);
             break;
+        OPCODE_CASE(TRB):
+        OPCODE_CASE(TSB):
         default:
             unhandled_opcode = 1;
             break;
     };
     if (unhandled_opcode)
     {
-        printf("error %04x Opcode %s not implemented yet.\n",
-               old_pc, OPCODE_STRINGS[opcode]);
-        fflush(stdout);
+        emit_error(ctx, "Opcode %s not implemented yet.", OPCODE_STRINGS[opcode]);
         fprintf(stderr, "Opcode %s not implemented yet at PC 0x%04x.\n",
-                OPCODE_STRINGS[opcode], cpu.pc);
-        exit(1);
+                OPCODE_STRINGS[opcode], ctx->cpu.pc);
+        stop_run(ctx);
     }
-    cpu.total_cycles += cycles;
-    if (trace_stack_pointer < 0xff)
-        cycles_per_function[trace_stack_function[trace_stack_pointer + 1]] += cycles;
-    if (show_log)
-    {
-        printf("log %04x %02x %02x %02x %04x %02x %02x\n",
-               old_pc, cpu.a, cpu.x, cpu.y, cpu.pc, cpu.sp, cpu.flags);
-        fflush(stdout);
+    ctx->cpu.total_cycles += cycles;
+    return cycles;
+}
+
+/*
+ * The functions below take the features of the current run as compile time
+ * constants, they get inlined into the specialized main loops.
+ */
+#define RUN_WATCHES     0x01
+#define RUN_LOG         0x02
+#define RUN_BLOCK_CACHE 0x04
+#define RUN_FRAME_START 0x08
+#define RUN_IO          0x10 // reads go through read8(): read handlers or heat map
+#define RUN_PER_ADDRESS 0x20 // --heat-map or --page-crossings
+
+static ALWAYS_INLINE uint8_t execute_and_log_instruction(r_context* ctx, const int features, uint8_t read_opcode, uint16_t operand)
+{
+    uint8_t cycles = execute_instruction(ctx, (features & RUN_IO) != 0, read_opcode, operand);
+    if (features & RUN_LOG)
+        record_log(ctx, ctx->old_pc);
+    return cycles;
+}
+
+/*
+ * Splits the cycles of the instruction at old_pc. Anything above the base
+ * cycles is a penalty: one cycle for a taken branch plus one if its target
+ * is on another page, or one for indexed addressing crossing a page.
+ */
+void record_pc_cycles(r_context* ctx, uint8_t read_opcode, uint8_t cycles)
+{
+    r_opcode_entry* entry = &opcode_table[read_opcode];
+    r_pc_cycles* pc_cycles = &ctx->pc_cycles[ctx->old_pc];
+    uint8_t penalty = cycles - entry->cycles;
+    pc_cycles->count++;
+    pc_cycles->base_cycles += entry->cycles;
+    if (entry->addressing_mode == relative)
+    {
+        if (penalty > 0)
+            pc_cycles->branch_taken_cycles++;
+        if (penalty > 1)
+            pc_cycles->branch_page_crossing_cycles++;
+    }
+    else
+        pc_cycles->page_crossing_cycles += penalty;
+}
+
+static ALWAYS_INLINE void handle_next_opcode(r_context* ctx, const int features)
+{
+    ctx->old_pc = ctx->cpu.pc;
+
+    // fetch opcode and operand of the next instruction
+    uint8_t read_opcode = rpc8(ctx);
+    uint16_t operand = 0;
+    if (opcode_table[read_opcode].length == 2)
+        operand = rpc8(ctx);
+    else if (opcode_table[read_opcode].length == 3)
+        operand = rpc16(ctx);
+    if ((features & RUN_PER_ADDRESS) && ctx->heat_map)
+        for (uint16_t pc = ctx->old_pc; pc != ctx->cpu.pc; pc++)
+            ctx->heat_map[HEAT_MAP_FETCHES * 0x10000 + pc]++;
+
+    uint8_t cycles = execute_and_log_instruction(ctx, features, read_opcode, operand);
+    if ((features & RUN_PER_ADDRESS) && ctx->pc_cycles)
+        record_pc_cycles(ctx, read_opcode, cycles);
+    ctx->instruction_count++;
+    if (ctx->trace_stack_pointer < 0xff)
+        ctx->cycles_per_function[ctx->trace_stack_function[ctx->trace_stack_pointer + 1]] += cycles;
+}
+
+uint8_t ends_block(r_opcode opcode)
+{
+    switch (opcode)
+    {
+        case NO_OPCODE:
+        case BCC: case BCS: case BEQ: case BMI: case BNE: case BPL:
+        case BRA: case BVC: case BVS:
+        case JMP: case JSR: case RTS: case RTI: case BRK:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+uint8_t has_watch(r_context* ctx, uint16_t pc)
+{
+    return ctx->watch_offset_for_pc_and_post[(int32_t)pc << 1] != -1 ||
+           ctx->watch_offset_for_pc_and_post[((int32_t)pc << 1) | 1] != -1;
+}
+
+r_block* translate_block(r_context* ctx, uint16_t pc)
+{
+    if (ctx->page_invalidations[pc >> 8] >= MAX_PAGE_INVALIDATIONS)
+        return 0;
+    if (ctx->block_pool_used == BLOCK_POOL_SIZE)
+        flush_block_cache(ctx);
+
+    r_block* block = &ctx->block_pool[ctx->block_pool_used];
+    block->start_pc = pc;
+    block->branch_target = 0;
+    block->cycles = 0;
+    block->instruction_count = 0;
+    block->entry_count = 0;
+    block->jit_function = 0;
+    while (block->instruction_count < MAX_BLOCK_INSTRUCTIONS)
+    {
+        r_opcode_entry* entry = &opcode_table[ctx->ram[pc]];
+        uint16_t next_pc = pc + entry->length;
+        uint8_t watched = has_watch(ctx, pc);
+        if (block->instruction_count > 0 && watched)
+            break;
+        if (ctx->page_invalidations[(uint16_t)(next_pc - 1) >> 8] >= MAX_PAGE_INVALIDATIONS)
+        {
+            if (block->instruction_count == 0)
+                return 0;
+            break;
+        }
+
+        r_block_instruction* instruction = &block->instructions[block->instruction_count++];
+        instruction->pc = pc;
+        instruction->next_pc = next_pc;
+        instruction->read_opcode = ctx->ram[pc];
+        instruction->operand = 0;
+        if (entry->length == 2)
+            instruction->operand = ctx->ram[(uint16_t)(pc + 1)];
+        else if (entry->length == 3)
+            instruction->operand = ctx->ram[(uint16_t)(pc + 1)] | ((uint16_t)ctx->ram[(uint16_t)(pc + 2)] << 8);
+        block->cycles += entry->cycles;
+        ctx->write_page_flags[pc >> 8] |= WRITE_FLAG_CODE;
+        ctx->write_page_flags[(uint16_t)(next_pc - 1) >> 8] |= WRITE_FLAG_CODE;
+
+        if (ends_block(entry->opcode))
+        {
+            if (entry->addressing_mode == relative)
+                block->branch_target = next_pc + (int8_t)instruction->operand;
+            else if (entry->addressing_mode == absolute)
+                block->branch_target = instruction->operand;
+            pc = next_pc;
+            break;
+        }
+        if (watched || next_pc == ctx->start_frame_pc || next_pc < pc)
+        {
+            pc = next_pc;
+            break;
+        }
+        pc = next_pc;
+    }
+    block->end_pc = pc;
+    block->next_in_page = ctx->blocks_for_page[block->start_pc >> 8];
+    ctx->blocks_for_page[block->start_pc >> 8] = block;
+    ctx->block_for_pc[block->start_pc] = block;
+    ctx->block_pool_used++;
+    return block;
+}
+
+void add_cycles_to_current_function(r_context* ctx, uint64_t cycles)
+{
+    if (ctx->trace_stack_pointer < 0xff)
+        ctx->cycles_per_function[ctx->trace_stack_function[ctx->trace_stack_pointer + 1]] += cycles;
+}
+
+#ifdef JIT
+
+// code generation happens on the thread running the context
+_Thread_local uint8_t* jit_p = 0;
+
+void jit8(uint8_t x)
+{
+    *(jit_p++) = x;
+}
+
+void jit32(uint32_t x)
+{
+    memcpy(jit_p, &x, 4);
+    jit_p += 4;
+}
+
+void jit64(uint64_t x)
+{
+    memcpy(jit_p, &x, 8);
+    jit_p += 8;
+}
+
+// movzx reg, byte [rbx + offset]
+void jit_load_cpu(int reg, int offset)
+{
+    jit8(0x0f); jit8(0xb6); jit8(0x40 | (reg << 3) | EBX); jit8(offset);
+}
+
+// mov byte [rbx + offset], reg8
+void jit_store_cpu(int reg, int offset)
+{
+    jit8(0x88); jit8(0x40 | (reg << 3) | EBX); jit8(offset);
+}
+
+// movzx reg, byte [r12 + address]
+void jit_load_ram_absolute(int reg, uint32_t address)
+{
+    jit8(0x41); jit8(0x0f); jit8(0xb6); jit8(0x84 | (reg << 3)); jit8(0x24); jit32(address);
+}
+
+// movzx reg, byte [r12 + index + displacement]
+void jit_load_ram_indexed(int reg, int index, int8_t displacement)
+{
+    jit8(0x41); jit8(0x0f); jit8(0xb6); jit8(0x44 | (reg << 3)); jit8((index << 3) | 4); jit8(displacement);
+}
+
+// mov byte [r12 + index], reg8
+void jit_store_ram_indexed(int reg, int index)
+{
+    jit8(0x41); jit8(0x88); jit8(0x04 | (reg << 3)); jit8((index << 3) | 4);
+}
+
+// mov reg, imm32
+void jit_mov_imm(int reg, uint32_t value)
+{
+    jit8(0xb8 | reg); jit32(value);
+}
+
+// <op> reg, imm32
+void jit_alu_imm(int op, int reg, uint32_t value)
+{
+    jit8(0x81); jit8(0xc0 | (op << 3) | reg); jit32(value);
+}
+
+// <op> dst, src (op is the x86 opcode byte for r/m32, r32)
+void jit_alu_reg(uint8_t op, int dst, int src)
+{
+    jit8(op); jit8(0xc0 | (src << 3) | dst);
+}
+
+#define jit_add_reg(dst, src) jit_alu_reg(0x01, dst, src)
+#define jit_or_reg(dst, src)  jit_alu_reg(0x09, dst, src)
+#define jit_and_reg(dst, src) jit_alu_reg(0x21, dst, src)
+#define jit_sub_reg(dst, src) jit_alu_reg(0x29, dst, src)
+#define jit_xor_reg(dst, src) jit_alu_reg(0x31, dst, src)
+#define jit_cmp_reg(dst, src) jit_alu_reg(0x39, dst, src)
+#define jit_mov_reg(dst, src) jit_alu_reg(0x89, dst, src)
+
+// movzx dst, src8
+void jit_movzx_reg(int dst, int src)
+{
+    jit8(0x0f); jit8(0xb6); jit8(0xc0 | (dst << 3) | src);
+}
+
+void jit_shl(int reg, uint8_t count)
+{
+    jit8(0xc1); jit8(0xe0 | reg); jit8(count);
+}
+
+void jit_shr(int reg, uint8_t count)
+{
+    jit8(0xc1); jit8(0xe8 | reg); jit8(count);
+}
+
+// test reg8, reg8
+void jit_test_byte(int reg)
+{
+    jit8(0x84); jit8(0xc0 | (reg << 3) | reg);
+}
+
+// test eax, imm32
+void jit_test_eax(uint32_t value)
+{
+    jit8(0xa9); jit32(value);
+}
+
+// jcc rel8, returns the location of the displacement to patch
+uint8_t* jit_jcc8(uint8_t cc)
+{
+    jit8(0x70 | cc); jit8(0);
+    return jit_p - 1;
+}
+
+// jcc rel32 (cc < 0 emits jmp), returns the location of the displacement to patch
+uint8_t* jit_jcc32(int cc)
+{
+    if (cc < 0)
+        jit8(0xe9);
+    else
+    {
+        jit8(0x0f); jit8(0x80 | cc);
     }
+    jit32(0);
+    return jit_p - 4;
+}
+
+void jit_patch8(uint8_t* displacement)
+{
+    *displacement = jit_p - (displacement + 1);
+}
+
+void jit_patch32(uint8_t* displacement)
+{
+    int32_t offset = jit_p - (displacement + 4);
+    memcpy(displacement, &offset, 4);
+}
+
+// inc r14
+void jit_add_penalty()
+{
+    jit8(0x49); jit8(0xff); jit8(0xc6);
 }
 
-int parse_int(const char* s, int base)
+// add qword [rbx + total_cycles], imm32
+void jit_add_cycles(uint32_t cycles)
+{
+    jit8(0x48); jit8(0x81); jit8(0x43); jit8(offsetof(r_cpu, total_cycles)); jit32(cycles);
+}
+
+// mov word [rbx + pc], imm16
+void jit_set_pc(uint16_t pc)
+{
+    jit8(0x66); jit8(0xc7); jit8(0x43); jit8(offsetof(r_cpu, pc)); jit8(pc & 0xff); jit8(pc >> 8);
+}
+
+// mov rdi, imm64, the first argument of called functions
+void jit_pass_context(r_context* ctx)
+{
+    jit8(0x48); jit8(0xbf); jit64((uint64_t)ctx);
+}
+
+// mov rax, imm64; call rax
+void jit_call(void* function)
+{
+    jit8(0x48); jit8(0xb8); jit64((uint64_t)function);
+    jit8(0xff); jit8(0xd0);
+}
+
+void jit_load_flags()
+{
+    jit_load_cpu(EDX, offsetof(r_cpu, flags));
+}
+
+void jit_store_flags()
+{
+    jit_store_cpu(EDX, offsetof(r_cpu, flags));
+}
+
+// flags are kept in edx, set flag if condition cc holds (after a cmp or test)
+void jit_set_flag_if(uint8_t cc, uint8_t flag)
+{
+    uint8_t* skip = jit_jcc8(cc ^ 1);
+    jit_alu_imm(X86_OR, EDX, flag);
+    jit_patch8(skip);
+}
+
+// setcc byte [rbx + carry]
+void jit_set_carry_if(uint8_t cc)
+{
+    jit8(0x0f); jit8(0x90 | cc); jit8(0x43); jit8(offsetof(r_cpu, carry));
+}
+
+// mov byte [rbx + carry], imm8
+void jit_set_carry(uint8_t value)
+{
+    jit8(0xc6); jit8(0x43); jit8(offsetof(r_cpu, carry)); jit8(value);
+}
+
+void jit_update_zero_and_negative_flags(int reg)
+{
+    jit_store_cpu(reg, offsetof(r_cpu, zero_result));
+    jit_store_cpu(reg, offsetof(r_cpu, negative_result));
+}
+
+/*
+ * Computes the target address of a memory operand into ecx, adding page
+ * crossing penalties to r14 in exactly the same way as execute_instruction().
+ */
+void jit_target_address(r_addressing_mode addressing_mode, uint16_t operand)
+{
+    switch (addressing_mode)
+    {
+        case absolute:
+        case zero_page:
+            jit_mov_imm(ECX, operand);
+            break;
+        case zero_page_x:
+        case zero_page_y:
+            jit_load_cpu(ECX, addressing_mode == zero_page_x ? offsetof(r_cpu, x) : offsetof(r_cpu, y));
+            jit_alu_imm(X86_ADD, ECX, operand);
+            jit_alu_imm(X86_AND, ECX, 0xff);
+            break;
+        case absolute_x:
+        case absolute_y:
+        {
+            jit_load_cpu(ECX, addressing_mode == absolute_x ? offsetof(r_cpu, x) : offsetof(r_cpu, y));
+            jit_alu_imm(X86_ADD, ECX, operand);
+            jit_mov_reg(ESI, ECX);
+            jit_shr(ESI, 8);
+            jit_alu_imm(X86_CMP, ESI, operand >> 8);
+            uint8_t* skip = jit_jcc8(CC_E);
+            jit_add_penalty();
+            jit_patch8(skip);
+            jit_alu_imm(X86_AND, ECX, 0xffff);
+            break;
+        }
+        case zero_page_indirect:
+        case indirect_indexed_y:
+        {
+            jit_load_ram_absolute(ECX, (uint16_t)(operand + 1));
+            jit_shl(ECX, 8);
+            jit_load_ram_absolute(ESI, operand);
+            jit_or_reg(ECX, ESI);
+            if (addressing_mode == indirect_indexed_y)
+            {
+                // the page differs if (pointer ^ (pointer + y)) >> 8 != 0
+                jit_load_cpu(ESI, offsetof(r_cpu, y));
+                jit_add_reg(ESI, ECX);
+                jit_xor_reg(ECX, ESI);
+                jit_shr(ECX, 8);
+                uint8_t* skip = jit_jcc8(CC_E);
+                jit_add_penalty();
+                jit_patch8(skip);
+                jit_mov_reg(ECX, ESI);
+                jit_alu_imm(X86_AND, ECX, 0xffff);
+            }
+            break;
+        }
+        case indexed_indirect_x:
+            jit_load_cpu(ESI, offsetof(r_cpu, x));
+            jit_alu_imm(X86_ADD, ESI, operand);
+            jit_alu_imm(X86_AND, ESI, 0xff);
+            jit_load_ram_indexed(ECX, ESI, 1);
+            jit_shl(ECX, 8);
+            jit_load_ram_indexed(ESI, ESI, 0);
+            jit_or_reg(ECX, ESI);
+            break;
+        default:
+            break;
+    }
+}
+
+// loads the operand value into eax
+void jit_operand_value(r_addressing_mode addressing_mode, uint16_t operand)
+{
+    if (addressing_mode == immediate)
+        jit_mov_imm(EAX, operand);
+    else
+    {
+        jit_target_address(addressing_mode, operand);
+        jit_load_ram_indexed(EAX, ECX, 0);
+    }
+}
+
+void jit_record_log(r_context* ctx, r_block_instruction* instruction)
+{
+    if (!ctx->show_log)
+        return;
+    // branches and jumps have already set the PC
+    if (!ends_block(opcode_table[instruction->read_opcode].opcode))
+        jit_set_pc(instruction->next_pc);
+    jit_pass_context(ctx);
+    jit_mov_imm(ESI, instruction->pc);
+    jit_call(record_log);
+}
+
+/*
+ * Leaves the native code after instruction_index instructions, with
+ * cycles being the base cycles of these instructions.
+ */
+void jit_exit(r_context* ctx, r_block* block, int instruction_index, uint32_t cycles)
+{
+    if (instruction_index > 0)
+    {
+        jit_add_cycles(cycles);
+        // add qword [rbx + total_cycles], r14
+        jit8(0x4c); jit8(0x01); jit8(0x73); jit8(offsetof(r_cpu, total_cycles));
+        // mov rax, &old_pc; mov word [rax], imm16
+        jit8(0x48); jit8(0xb8); jit64((uint64_t)&ctx->old_pc);
+        uint16_t pc = block->instructions[instruction_index - 1].pc;
+        jit8(0x66); jit8(0xc7); jit8(0x00); jit8(pc & 0xff); jit8(pc >> 8);
+    }
+    jit_mov_imm(EAX, instruction_index);
+    // add rsp, 8; pop r14; pop r13; pop r12; pop rbx; ret
+    jit8(0x48); jit8(0x83); jit8(0xc4); jit8(0x08);
+    jit8(0x41); jit8(0x5e);
+    jit8(0x41); jit8(0x5d);
+    jit8(0x41); jit8(0x5c);
+    jit8(0x5b);
+    jit8(0xc3);
+}
+
+/*
+ * Writes al to ram[ecx], records the log entry of this instruction and
+ * leaves the native code if the write has requested to leave the block.
+ */
+void jit_write_and_record_log(r_context* ctx, r_block* block, int instruction_index, uint32_t cycles)
+{
+    r_block_instruction* instruction = &block->instructions[instruction_index];
+    jit_store_ram_indexed(EAX, ECX);
+    // mov esi, ecx; shr esi, 8; cmp byte [r13 + rsi], 0
+    jit_mov_reg(ESI, ECX);
+    jit_shr(ESI, 8);
+    jit8(0x41); jit8(0x80); jit8(0x7c); jit8(0x35); jit8(0x00); jit8(0x00);
+    uint8_t* fast_path = jit_jcc32(CC_E);
+    jit_pass_context(ctx);
+    jit_mov_reg(ESI, ECX);
+    jit_call(handle_flagged_write);
+    jit_record_log(ctx, instruction);
+    // mov rax, &block_exit; cmp byte [rax], 0
+    jit8(0x48); jit8(0xb8); jit64((uint64_t)&ctx->block_exit);
+    jit8(0x80); jit8(0x38); jit8(0x00);
+    uint8_t* stay = jit_jcc32(CC_E);
+    jit_set_pc(instruction->next_pc);
+    jit_exit(ctx, block, instruction_index + 1, cycles);
+    jit_patch32(fast_path);
+    jit_record_log(ctx, instruction);
+    jit_patch32(stay);
+}
+
+uint8_t register_offset(r_opcode opcode)
+{
+    switch (opcode)
+    {
+        case LDX: case STX: case CPX: case INX: case DEX:
+            return offsetof(r_cpu, x);
+        case LDY: case STY: case CPY: case INY: case DEY:
+            return offsetof(r_cpu, y);
+        default:
+            return offsetof(r_cpu, a);
+    }
+}
+
+/*
+ * Translates a single instruction, returns 0 if the instruction is not
+ * supported. cycles are the base cycles up to and including this instruction.
+ */
+uint8_t jit_instruction(r_context* ctx, r_block* block, int instruction_index, uint32_t cycles)
+{
+    r_block_instruction* instruction = &block->instructions[instruction_index];
+    r_opcode_entry* entry = &opcode_table[instruction->read_opcode];
+    r_addressing_mode addressing_mode = entry->addressing_mode;
+    uint16_t operand = instruction->operand;
+    uint8_t reg = register_offset(entry->opcode);
+    uint8_t flag_mask = 0;
+    uint8_t flag_value = 0;
+
+    switch (entry->opcode)
+    {
+        case LDA: case LDX: case LDY:
+            jit_operand_value(addressing_mode, operand);
+            jit_store_cpu(EAX, reg);
+            jit_update_zero_and_negative_flags(EAX);
+            break;
+        case STA: case STX: case STY: case STZ:
+            jit_target_address(addressing_mode, operand);
+            if (entry->opcode == STZ)
+                jit_xor_reg(EAX, EAX);
+            else
+                jit_load_cpu(EAX, reg);
+            jit_write_and_record_log(ctx, block, instruction_index, cycles);
+            return 1;
+        case AND: case ORA: case EOR:
+            jit_operand_value(addressing_mode, operand);
+            jit_load_cpu(ECX, offsetof(r_cpu, a));
+            if (entry->opcode == AND)
+                jit_and_reg(ECX, EAX);
+            else if (entry->opcode == ORA)
+                jit_or_reg(ECX, EAX);
+            else
+                jit_xor_reg(ECX, EAX);
+            jit_store_cpu(ECX, offsetof(r_cpu, a));
+            jit_update_zero_and_negative_flags(ECX);
+            break;
+        case ADC: case SBC:
+            // decimal mode has been ruled out on block entry
+            jit_operand_value(addressing_mode, operand);
+            jit_mov_reg(EDI, EAX);
+            if (entry->opcode == SBC)
+                jit_alu_imm(X86_XOR, EAX, 0xff);
+            jit_load_cpu(ECX, offsetof(r_cpu, a));
+            jit_add_reg(ECX, EAX);
+            jit_load_cpu(ESI, offsetof(r_cpu, carry));
+            jit_add_reg(ECX, ESI);
+            jit_store_cpu(ECX, offsetof(r_cpu, a));
+            jit_alu_imm(X86_CMP, ECX, 0xff);
+            jit_set_carry_if(CC_A);
+            jit_update_zero_and_negative_flags(ECX);
+            // overflow = (t16 ^ a) & (t16 ^ value) & 0x80
+            jit_load_flags();
+            jit_alu_imm(X86_AND, EDX, (uint8_t)~OVERFLOW);
+            jit_movzx_reg(ESI, ECX);
+            jit_xor_reg(ESI, ECX);
+            jit_xor_reg(EDI, ECX);
+            jit_and_reg(ESI, EDI);
+            jit_alu_imm(X86_AND, ESI, 0x80);
+            jit_set_flag_if(CC_NE, OVERFLOW);
+            jit_store_flags();
+            break;
+        case CMP: case CPX: case CPY:
+            jit_operand_value(addressing_mode, operand);
+            jit_load_cpu(ECX, reg);
+            jit_cmp_reg(ECX, EAX);
+            jit_set_carry_if(CC_AE);
+            jit_sub_reg(ECX, EAX);
+            jit_update_zero_and_negative_flags(ECX);
+            break;
+        case BIT:
+            jit_operand_value(addressing_mode, operand);
+            jit_load_cpu(ECX, offsetof(r_cpu, a));
+            jit_and_reg(ECX, EAX);
+            jit_store_cpu(ECX, offsetof(r_cpu, zero_result));
+            jit_store_cpu(EAX, offsetof(r_cpu, negative_result));
+            jit_load_flags();
+            jit_alu_imm(X86_AND, EDX, (uint8_t)~OVERFLOW);
+            jit_alu_imm(X86_AND, EAX, OVERFLOW);
+            jit_or_reg(EDX, EAX);
+            jit_store_flags();
+            break;
+        case INC: case DEC:
+            jit_target_address(addressing_mode, operand);
+            jit_load_ram_indexed(EAX, ECX, 0);
+            jit_alu_imm(entry->opcode == INC ? X86_ADD : X86_SUB, EAX, 1);
+            jit_update_zero_and_negative_flags(EAX);
+            jit_write_and_record_log(ctx, block, instruction_index, cycles);
+            return 1;
+        case INX: case INY: case INA: case DEX: case DEY: case DEA:
+            jit_load_cpu(EAX, reg);
+            jit_alu_imm((entry->opcode == INX || entry->opcode == INY || entry->opcode == INA) ? X86_ADD : X86_SUB, EAX, 1);
+            jit_store_cpu(EAX, reg);
+            jit_update_zero_and_negative_flags(EAX);
+            break;
+        case ASL: case LSR: case ROL: case ROR:
+            if (addressing_mode == accumulator)
+                jit_load_cpu(EAX, offsetof(r_cpu, a));
+            else
+            {
+                jit_target_address(addressing_mode, operand);
+                jit_load_ram_indexed(EAX, ECX, 0);
+            }
+            if (entry->opcode == ROL || entry->opcode == ROR)
+                jit_load_cpu(EDI, offsetof(r_cpu, carry));
+            jit_test_eax((entry->opcode == ASL || entry->opcode == ROL) ? 0x80 : 0x01);
+            jit_set_carry_if(CC_NE);
+            if (entry->opcode == ASL || entry->opcode == ROL)
+                jit_shl(EAX, 1);
+            else
+                jit_shr(EAX, 1);
+            if (entry->opcode == ROL)
+                jit_or_reg(EAX, EDI);
+            else if (entry->opcode == ROR)
+            {
+                jit_shl(EDI, 7);
+                jit_or_reg(EAX, EDI);
+            }
+            jit_update_zero_and_negative_flags(EAX);
+            if (addressing_mode != accumulator)
+            {
+                jit_write_and_record_log(ctx, block, instruction_index, cycles);
+                return 1;
+            }
+            jit_store_cpu(EAX, offsetof(r_cpu, a));
+            break;
+        case TAX: case TAY: case TXA: case TYA:
+            jit_load_cpu(EAX, (entry->opcode == TXA) ? offsetof(r_cpu, x) :
+                              (entry->opcode == TYA) ? offsetof(r_cpu, y) : offsetof(r_cpu, a));
+            jit_store_cpu(EAX, (entry->opcode == TAX) ? offsetof(r_cpu, x) :
+                               (entry->opcode == TAY) ? offsetof(r_cpu, y) : offsetof(r_cpu, a));
+            jit_update_zero_and_negative_flags(EAX);
+            break;
+        case TSX:
+            jit_load_cpu(EAX, offsetof(r_cpu, sp));
+            jit_store_cpu(EAX, offsetof(r_cpu, x));
+            jit_update_zero_and_negative_flags(EAX);
+            break;
+        case TXS:
+            jit_load_cpu(EAX, offsetof(r_cpu, x));
+            jit_store_cpu(EAX, offsetof(r_cpu, sp));
+            break;
+        case CLC: case SEC:
+            jit_set_carry(entry->opcode == SEC);
+            break;
+        case CLD: case CLI: case CLV: case SEI:
+            jit_load_flags();
+            if (entry->opcode == CLD)
+                flag_mask = DECIMAL_MODE;
+            else if (entry->opcode == CLI || entry->opcode == SEI)
+                flag_mask = INTERRUPT_DISABLE;
+            else
+                flag_mask = OVERFLOW;
+            if (entry->opcode == SEI)
+                flag_value = flag_mask;
+            jit_alu_imm(X86_AND, EDX, (uint8_t)~flag_mask);
+            if (flag_value)
+                jit_alu_imm(X86_OR, EDX, flag_value);
+            jit_store_flags();
+            break;
+        case NOP:
+            break;
+        case JMP:
+            if (addressing_mode != absolute)
+                return 0;
+            jit_set_pc(operand);
+            jit_record_log(ctx, instruction);
+            return 1;
+        case BCC: case BCS: case BEQ: case BMI: case BNE: case BPL:
+        case BVC: case BVS: case BRA:
+        {
+            uint16_t target = instruction->next_pc + (int8_t)operand;
+            uint8_t* taken = 0;
+            if (entry->opcode != BRA)
+            {
+                uint8_t branch_if_set = (entry->opcode == BCS || entry->opcode == BEQ ||
+                                         entry->opcode == BMI || entry->opcode == BVS);
+                // x86 condition if the flag is set
+                uint8_t flag_set = CC_NE;
+                // test byte [rbx + offset], imm8
+                jit8(0xf6); jit8(0x43);
+                switch (entry->opcode)
+                {
+                    case BCC: case BCS:
+                        jit8(offsetof(r_cpu, carry)); jit8(0xff);
+                        break;
+                    case BEQ: case BNE:
+                        jit8(offsetof(r_cpu, zero_result)); jit8(0xff);
+                        flag_set = CC_E;
+                        break;
+                    case BMI: case BPL:
+                        jit8(offsetof(r_cpu, negative_result)); jit8(NEGATIVE);
+                        break;
+                    default:
+                        jit8(offsetof(r_cpu, flags)); jit8(OVERFLOW);
+                        break;
+                }
+                taken = jit_jcc32(branch_if_set ? flag_set : flag_set ^ 1);
+                jit_set_pc(instruction->next_pc);
+                uint8_t* done = jit_jcc32(-1);
+                jit_patch32(taken);
+                taken = done;
+            }
+            // same penalties as branch()
+            jit_add_penalty();
+            if ((instruction->next_pc & 0xff00) != ((instruction->next_pc + (int8_t)operand) & 0xff00))
+                jit_add_penalty();
+            jit_set_pc(target);
+            if (taken)
+                jit_patch32(taken);
+            jit_record_log(ctx, instruction);
+            return 1;
+        }
+        default:
+            return 0;
+    }
+    jit_record_log(ctx, instruction);
+    return 1;
+}
+
+uint8_t jit_translatable(r_opcode opcode)
+{
+    switch (opcode)
+    {
+        case NO_OPCODE:
+        case JSR: case RTS: case RTI: case BRK:
+        case PHA: case PHP: case PHX: case PHY:
+        case PLA: case PLP: case PLX: case PLY:
+        case SED: case TRB: case TSB:
+            return 0;
+        default:
+            return 1;
+    }
+}
+
+/*
+ * Native code reads ram directly, so reads which may hit a page with a
+ * read handler are left to the interpreter.
+ */
+uint8_t jit_reads_io(r_context* ctx, r_opcode_entry* entry, uint16_t operand)
+{
+    switch (entry->opcode)
+    {
+        case STA: case STX: case STY: case STZ: case JMP:
+            return 0;
+        default:
+            break;
+    }
+    switch (entry->addressing_mode)
+    {
+        case accumulator:
+        case immediate:
+        case implied:
+        case relative:
+            return 0;
+        case absolute:
+        case zero_page:
+            return ctx->read_handlers[operand >> 8] != 0;
+        default:
+            return 1;
+    }
+}
+
+/*
+ * Native code doesn't keep old_pc and the cycle count up to date, which
+ * write watch events need, so writes which may hit a watched page are left
+ * to the interpreter as well.
+ */
+uint8_t jit_writes_watched(r_context* ctx, r_opcode_entry* entry, uint16_t operand)
+{
+    switch (entry->opcode)
+    {
+        case STA: case STX: case STY: case STZ:
+        case INC: case DEC: case ASL: case LSR: case ROL: case ROR:
+            break;
+        default:
+            return 0;
+    }
+    switch (entry->addressing_mode)
+    {
+        case accumulator:
+            return 0;
+        case absolute:
+        case zero_page:
+            return (ctx->write_page_flags[operand >> 8] & WRITE_FLAG_WATCH) != 0;
+        default:
+            return 1;
+    }
+}
+
+/*
+ * Translates the longest supported prefix of a block to native code.
+ * Returns 0 if not even the first instruction is supported.
+ */
+r_jit_function jit_translate_block(r_context* ctx, r_block* block)
+{
+    int count = 0;
+    uint8_t uses_carry_arithmetic = 0;
+    while (count < block->instruction_count)
+    {
+        r_block_instruction* instruction = &block->instructions[count];
+        r_opcode_entry* entry = &opcode_table[instruction->read_opcode];
+        if (!jit_translatable(entry->opcode))
+            break;
+        if (entry->opcode == JMP && entry->addressing_mode != absolute)
+            break;
+        if (ctx->read_handler_count > 0 && jit_reads_io(ctx, entry, instruction->operand))
+            break;
+        if (ctx->has_write_watches && jit_writes_watched(ctx, entry, instruction->operand))
+            break;
+        if (entry->opcode == ADC || entry->opcode == SBC)
+            uses_carry_arithmetic = 1;
+        count++;
+    }
+    if (count == 0)
+        return 0;
+
+    uint8_t* start = ctx->jit_buffer + ctx->jit_buffer_used;
+    jit_p = start;
+
+    // push rbx; push r12; push r13; push r14; sub rsp, 8
+    jit8(0x53);
+    jit8(0x41); jit8(0x54);
+    jit8(0x41); jit8(0x55);
+    jit8(0x41); jit8(0x56);
+    jit8(0x48); jit8(0x83); jit8(0xec); jit8(0x08);
+    // mov rbx, &cpu; mov r12, ram; mov r13, write_page_flags; xor r14d, r14d
+    jit8(0x48); jit8(0xbb); jit64((uint64_t)&ctx->cpu);
+    jit8(0x49); jit8(0xbc); jit64((uint64_t)ctx->ram);
+    jit8(0x49); jit8(0xbd); jit64((uint64_t)ctx->write_page_flags);
+    jit8(0x45); jit8(0x31); jit8(0xf6);
+
+    if (uses_carry_arithmetic)
+    {
+        // leave decimal mode to the interpreter
+        jit8(0xf6); jit8(0x43); jit8(offsetof(r_cpu, flags)); jit8(DECIMAL_MODE);
+        uint8_t* binary_mode = jit_jcc32(CC_E);
+        jit_exit(ctx, block, 0, 0);
+        jit_patch32(binary_mode);
+    }
+
+    uint32_t cycles = 0;
+    for (int i = 0; i < count; i++)
+    {
+        cycles += opcode_table[block->instructions[i].read_opcode].cycles;
+        jit_instruction(ctx, block, i, cycles);
+    }
+    r_block_instruction* last = &block->instructions[count - 1];
+    if (!ends_block(opcode_table[last->read_opcode].opcode))
+        jit_set_pc(last->next_pc);
+    jit_exit(ctx, block, count, cycles);
+
+    ctx->jit_buffer_used += jit_p - start;
+    return (r_jit_function)start;
+}
+
+/*
+ * Runs the native code of a block, translating it first if it has become
+ * hot. Returns the number of instructions executed.
+ */
+uint8_t run_jit(r_context* ctx, r_block* block)
+{
+    if (!block->jit_function)
+    {
+        if (block->entry_count == JIT_THRESHOLD)
+            return 0;
+        if (++block->entry_count < JIT_THRESHOLD)
+            return 0;
+        if (ctx->jit_buffer_used + JIT_MAX_BLOCK_CODE_SIZE > JIT_BUFFER_SIZE)
+        {
+            ctx->jit_flush_requested = 1;
+            block->entry_count--;
+            return 0;
+        }
+        block->jit_function = jit_translate_block(ctx, block);
+        if (!block->jit_function)
+            return 0;
+    }
+    if (!ctx->jit_verify)
+        return block->jit_function();
+
+    // run the native code, then run the interpreter from the same state
+    // and compare the results
+    static _Thread_local uint8_t ram_before[0x10000];
+    static _Thread_local uint8_t ram_after[0x10000];
+    static _Thread_local uint8_t write_page_flags_before[0x100];
+    static _Thread_local uint8_t page_invalidations_before[0x100];
+    r_cpu cpu_before = ctx->cpu;
+    uint16_t old_pc_before = ctx->old_pc;
+    uint32_t log_ring_position_before = ctx->log_ring_position;
+    uint8_t log_ring_full_before = ctx->log_ring_full;
+    uint32_t key_position_before = ctx->key_position;
+    memcpy(ram_before, ctx->ram, sizeof(ctx->ram));
+    memcpy(write_page_flags_before, ctx->write_page_flags, sizeof(ctx->write_page_flags));
+    memcpy(page_invalidations_before, ctx->page_invalidations, sizeof(ctx->page_invalidations));
+
+    uint8_t count = block->jit_function();
+    r_cpu cpu_after = ctx->cpu;
+    uint8_t flags_after = get_flags(ctx);
+    uint16_t old_pc_after = ctx->old_pc;
+    uint8_t block_exit_after = ctx->block_exit;
+    memcpy(ram_after, ctx->ram, sizeof(ctx->ram));
+
+    ctx->cpu = cpu_before;
+    ctx->old_pc = old_pc_before;
+    ctx->log_ring_position = log_ring_position_before;
+    ctx->log_ring_full = log_ring_full_before;
+    // write handlers get called a second time by the interpreter
+    ctx->key_position = key_position_before;
+    memcpy(ctx->ram, ram_before, sizeof(ctx->ram));
+    // let the interpreter see the same flagged pages, blocks which have
+    // been invalidated already stay invalidated
+    memcpy(ctx->write_page_flags, write_page_flags_before, sizeof(ctx->write_page_flags));
+    memcpy(ctx->page_invalidations, page_invalidations_before, sizeof(ctx->page_invalidations));
+    ctx->block_exit = 0;
+    for (int i = 0; i < count; i++)
+    {
+        ctx->old_pc = block->instructions[i].pc;
+        ctx->cpu.pc = block->instructions[i].next_pc;
+        execute_instruction(ctx, ctx->read_handler_count > 0,
+                            block->instructions[i].read_opcode, block->instructions[i].operand);
+        if (ctx->show_log)
+            record_log(ctx, ctx->old_pc);
+    }
+
+    if (ctx->cpu.pc != cpu_after.pc || ctx->cpu.sp != cpu_after.sp || ctx->cpu.a != cpu_after.a ||
+        ctx->cpu.x != cpu_after.x || ctx->cpu.y != cpu_after.y || get_flags(ctx) != flags_after ||
+        ctx->cpu.total_cycles != cpu_after.total_cycles || ctx->old_pc != old_pc_after ||
+        ctx->block_exit != block_exit_after || memcmp(ctx->ram, ram_after, sizeof(ctx->ram)) != 0)
+    {
+        fprintf(stderr, "JIT mismatch in block at 0x%04x after %d instructions:\n", block->start_pc, count);
+        fprintf(stderr, "         PC    SP A  X  Y  flags cycles\n");
+        fprintf(stderr, "JIT:     %04x  %02x %02x %02x %02x %02x    %" PRIu64 "\n",
+                cpu_after.pc, cpu_after.sp, cpu_after.a, cpu_after.x, cpu_after.y,
+                flags_after, cpu_after.total_cycles);
+        fprintf(stderr, "Interp.: %04x  %02x %02x %02x %02x %02x    %" PRIu64 "\n",
+                ctx->cpu.pc, ctx->cpu.sp, ctx->cpu.a, ctx->cpu.x, ctx->cpu.y, get_flags(ctx), ctx->cpu.total_cycles);
+        for (int i = 0; i < 0x10000; i++)
+            if (ctx->ram[i] != ram_after[i])
+                fprintf(stderr, "ram[0x%04x]: JIT %02x, interpreter %02x\n", i, ram_after[i], ctx->ram[i]);
+        emit_error(ctx, "JIT mismatch");
+        stop_run(ctx);
+    }
+    return count;
+}
+
+#endif
+
+static ALWAYS_INLINE void run_block(r_context* ctx, const int features, r_block* block)
+{
+    uint64_t start_cycles = ctx->cpu.total_cycles;
+    r_block_instruction* instruction = block->instructions;
+    r_block_instruction* last = instruction + block->instruction_count - 1;
+    ctx->block_exit = 0;
+#ifdef JIT
+    if (ctx->use_jit)
+    {
+        instruction += run_jit(ctx, block);
+        if (instruction > last || ctx->block_exit)
+        {
+            ctx->instruction_count += instruction - block->instructions;
+            add_cycles_to_current_function(ctx, ctx->cpu.total_cycles - start_cycles);
+            return;
+        }
+    }
+#endif
+    for (; instruction < last; instruction++)
+    {
+        ctx->old_pc = instruction->pc;
+        ctx->cpu.pc = instruction->next_pc;
+        execute_and_log_instruction(ctx, features, instruction->read_opcode, instruction->operand);
+        if (ctx->block_exit)
+        {
+            // the screen has been switched or this block has been invalidated
+            ctx->instruction_count += instruction - block->instructions + 1;
+            add_cycles_to_current_function(ctx, ctx->cpu.total_cycles - start_cycles);
+            return;
+        }
+    }
+    add_cycles_to_current_function(ctx, ctx->cpu.total_cycles - start_cycles);
+    // only the last instruction may be a JSR or RTS, its cycles are
+    // accounted to the function being called or returned to
+    ctx->old_pc = last->pc;
+    ctx->cpu.pc = last->next_pc;
+    add_cycles_to_current_function(ctx, execute_and_log_instruction(ctx, features, last->read_opcode, last->operand));
+    ctx->instruction_count += block->instruction_count;
+}
+
+static ALWAYS_INLINE void run_next_block(r_context* ctx, const int features)
+{
+#ifdef JIT
+    if (ctx->jit_flush_requested)
+        flush_block_cache(ctx);
+#endif
+    r_block* block = ctx->block_for_pc[ctx->cpu.pc];
+    if (!block)
+        block = translate_block(ctx, ctx->cpu.pc);
+    if (block)
+        run_block(ctx, features, block);
+    else
+        handle_next_opcode(ctx, features);
+}
+
+int parse_int(r_context* ctx, const char* s, int base)
 {
     char *p = 0;
     int i = strtol(s, &p, base);
     if (p == s)
     {
         fprintf(stderr, "Error parsing integer: %s", s);
-        exit(1);
+        stop_run(ctx);
     }
     return i;
 }
 
-void handle_watch(uint16_t pc, uint8_t post)
+void handle_watch(r_context* ctx, uint16_t pc, uint8_t post)
 {
-    int32_t offset = watch_offset_for_pc_and_post[((int32_t)pc << 1) | post];
+    int32_t offset = ctx->watch_offset_for_pc_and_post[((int32_t)pc << 1) | post];
     if (offset == -1)
         return;
 
-    int32_t old_index = -1;
-    while (watches[offset].pc == pc && watches[offset].post == post)
+    r_watch_event event;
+    event.value_count = 0;
+    while (offset < ctx->watch_count && ctx->watches[offset].pc == pc && ctx->watches[offset].post == post)
     {
-        r_watch* watch = &watches[offset];
+        r_watch* watch = &ctx->watches[offset];
         uint16_t watch_in_subroutine = 0;
-        for (int i = trace_stack_pointer + 1; i <= 0xff; i++)
+        for (int i = ctx->trace_stack_pointer + 1; i <= 0xff; i++)
         {
-            if (trace_stack[i] == cpu.sp + 2)
+            if (ctx->trace_stack[i] == ctx->cpu.sp + 2)
             {
-                watch_in_subroutine = trace_stack_function[i];
+                watch_in_subroutine = ctx->trace_stack_function[i];
                 break;
             }
         }
-        if (old_index == -1)
-            printf("watch 0x%04x %d %d", watch_in_subroutine, watch->index, cpu.total_cycles);
-        else
-            if (old_index != watch->index)
-                printf("\nwatch 0x%04x %d %d", watch_in_subroutine, watch->index, cpu.total_cycles);
+        if (event.value_count > 0 && event.index != watch->index)
+        {
+            emit_watch(ctx, &event);
+            event.value_count = 0;
+        }
+        if (event.value_count == 0)
+        {
+            event.subroutine = watch_in_subroutine;
+            event.index = watch->index;
+            event.cycles = ctx->cpu.total_cycles;
+        }
 
-        old_index = watch->index;
         int32_t value = 0;
         if (watch->type == MEMORY)
         {
             switch (watch->data_type)
             {
                 case u8:
-                    value = (uint8_t)read8(watch->memory_address);
+                    value = ctx->ram[watch->memory_address];
                     break;
                 case s8:
-                    value = (int8_t)read8(watch->memory_address);
+                    value = (int8_t)ctx->ram[watch->memory_address];
                     break;
                 case u16:
-                    value = (uint16_t)read16(watch->memory_address);
+                    value = peek16(ctx, watch->memory_address);
                     break;
                 case s16:
-                    value = (int16_t)read16(watch->memory_address);
+                    value = (int16_t)peek16(ctx, watch->memory_address);
                     break;
                 default:
                     fprintf(stderr, "Invalid data type!\n");
-                    exit(1);
+                    stop_run(ctx);
             }
-            printf(" %d", value);
         }
         else
         {
             switch (watch->type)
             {
                 case REGISTER_A:
-                    value = (watch->data_type == u8) ? (uint8_t)cpu.a : (int8_t)cpu.a;
+                    value = (watch->data_type == u8) ? (uint8_t)ctx->cpu.a : (int8_t)ctx->cpu.a;
                     break;
                 case REGISTER_X:
-                    value = (watch->data_type == u8) ? (uint8_t)cpu.x : (int8_t)cpu.x;
+                    value = (watch->data_type == u8) ? (uint8_t)ctx->cpu.x : (int8_t)ctx->cpu.x;
                     break;
                 case REGISTER_Y:
-                    value = (watch->data_type == u8) ? (uint8_t)cpu.y : (int8_t)cpu.y;
+                    value = (watch->data_type == u8) ? (uint8_t)ctx->cpu.y : (int8_t)ctx->cpu.y;
                     break;
                 default:
                     fprintf(stderr, "Invalid type!\n");
-                    exit(1);
+                    stop_run(ctx);
+            }
+        }
+        if (event.value_count < 2)
+            event.values[event.value_count++] = value;
+        offset++;
+    }
+    emit_watch(ctx, &event);
+}
+
+/*
+ * Returns the total cycles at which the main loop has to check the
+ * --max-cycles and --max-instructions limits again. Every instruction
+ * takes at least one cycle, so the remaining instructions can't finish
+ * any earlier.
+ */
+uint64_t next_limit_check(r_context* ctx)
+{
+    uint64_t next = UINT64_MAX;
+    if (ctx->max_cycles)
+        next = ctx->max_cycles;
+    if (ctx->max_instructions && ctx->instruction_count < ctx->max_instructions)
+    {
+        uint64_t cycles = ctx->cpu.total_cycles + (ctx->max_instructions - ctx->instruction_count);
+        if (cycles < next)
+            next = cycles;
+    }
+    return next;
+}
+
+uint8_t limit_reached(r_context* ctx)
+{
+    return (ctx->max_cycles && ctx->cpu.total_cycles >= ctx->max_cycles) ||
+           (ctx->max_instructions && ctx->instruction_count >= ctx->max_instructions);
+}
+
+/*
+ * The main loop, specialized for the features of the current run so that
+ * headless runs don't pay for watches, the execution log or frame
+ * detection they don't use. run_loop_variants holds one variant per
+ * combination of RUN_* features.
+ */
+static ALWAYS_INLINE void run_loop(r_context* ctx, const int features)
+{
+    uint8_t old_screen_number = 0;
+    uint64_t next_cycles_event = 0;
+    uint64_t next_check = 0; // cycles event or limit check, whatever comes first
+    while (!ctx->brk_encountered)
+    {
+        if (features & RUN_WATCHES)
+            handle_watch(ctx, ctx->cpu.pc, 0);
+        if (features & RUN_BLOCK_CACHE)
+            run_next_block(ctx, features);
+        else
+            handle_next_opcode(ctx, features);
+        // old_pc now points to the last instruction executed
+        if (features & RUN_WATCHES)
+            handle_watch(ctx, ctx->old_pc, 1);
+        if ((features & RUN_FRAME_START) && (ctx->cpu.pc == ctx->start_frame_pc))
+            record_frame_start(ctx);
+        if (ctx->cpu.total_cycles >= next_check)
+        {
+            if (ctx->cpu.total_cycles >= next_cycles_event)
+            {
+                uint64_t cycles = ctx->cpu.total_cycles - ctx->cpu.total_cycles % 100000;
+                emit_cycles(ctx, cycles);
+                next_cycles_event = cycles + 100000;
+                if (ctx->log_dumps_handled != log_dump_requests)
+                {
+                    ctx->log_dumps_handled = log_dump_requests;
+                    dump_log(ctx);
+                }
+                if (stop_requested)
+                {
+                    ctx->interrupted = 1;
+                    break;
+                }
+            }
+            if (limit_reached(ctx))
+                break;
+            uint64_t next_limit = next_limit_check(ctx);
+            next_check = next_limit < next_cycles_event ? next_limit : next_cycles_event;
+        }
+        if (ctx->ram[0x30b] != old_screen_number)
+        {
+            old_screen_number = ctx->ram[0x30b];
+            uint8_t current_screen = old_screen_number;
+            ctx->screen_count++;
+            if (!(features & RUN_FRAME_START))
+                record_frame_start(ctx);
+            if (ctx->show_screen || ctx->frames || ctx->gif)
+            {
+                uint8_t screen[40 * 192];
+                for (int y = 0; y < 192; y++)
+                {
+                    uint16_t line_offset = yoffset[y] | (current_screen == 1 ? 0x2000 : 0x4000);
+                    memcpy(screen + y * 40, ctx->ram + line_offset, 40);
+                }
+                r_screen_changes changes;
+                collect_screen_changes(ctx, current_screen, &changes);
+                if (ctx->frames || ctx->gif)
+                    record_screen(ctx, screen, &changes);
+                emit_screen(ctx, ctx->show_screen ? screen : 0, changes.redrawn);
             }
-            printf(" %d", value);
+            else
+                emit_screen(ctx, 0, 0);
+            if (ctx->screen_count == ctx->max_frames)
+                break;
         }
-        offset++;
     }
-    printf("\n");
-    fflush(stdout);
 }
 
-int main(int argc, char** argv)
-{
-    if (argc < 2)
-    {
-        printf("Usage: ./champ [options] <memory dump>\n");
-        printf("\n");
-        printf("Options:\n");
-        printf("  --hide-log\n");
-        printf("  --start-pc <address or label>\n");
-        printf("  --frame-start <address or label>\n");
-        printf("  --max-frames <n>\n");
-        printf("  --no-screen\n");
-        exit(1);
-    }
+#define RUN_LOOP_VARIANTS \
+    _(0x0) _(0x1) _(0x2) _(0x3) _(0x4) _(0x5) _(0x6) _(0x7) \
+    _(0x8) _(0x9) _(0xa) _(0xb) _(0xc) _(0xd) _(0xe) _(0xf) \
+    _(0x10) _(0x11) _(0x12) _(0x13) _(0x14) _(0x15) _(0x16) _(0x17) \
+    _(0x18) _(0x19) _(0x1a) _(0x1b) _(0x1c) _(0x1d) _(0x1e) _(0x1f) \
+    _(0x20) _(0x21) _(0x22) _(0x23) _(0x24) _(0x25) _(0x26) _(0x27) \
+    _(0x28) _(0x29) _(0x2a) _(0x2b) _(0x2c) _(0x2d) _(0x2e) _(0x2f) \
+    _(0x30) _(0x31) _(0x32) _(0x33) _(0x34) _(0x35) _(0x36) _(0x37) \
+    _(0x38) _(0x39) _(0x3a) _(0x3b) _(0x3c) _(0x3d) _(0x3e) _(0x3f)
 
-    for (int i = 0; i < 0x20000; i++)
-        watch_offset_for_pc_and_post[i] = -1;
+#define _(x) void run_loop_##x(r_context* ctx) { run_loop(ctx, x); }
+RUN_LOOP_VARIANTS
+#undef _
+
+#define _(x) run_loop_##x,
+void (* const run_loop_variants[])(r_context*) = { RUN_LOOP_VARIANTS };
+#undef _
 
+/*
+ * Reads watch definitions: the number of watches on the first line, then
+ * one watch per line, terminated by an empty line or the end of the file.
+ */
+void read_watches(r_context* ctx, FILE* f)
+{
     char s[1024];
     int watch_index = 0;
-    while (fgets(s, 1024, stdin))
+    uint8_t watches_allocated = 0;
+    while (fgets(s, 1024, f))
     {
         if (s[0] == '\n')
             break;
         if (!watches_allocated)
         {
-            watch_count = parse_int(s, 0);
-            if (watch_count > 0)
-                watches = malloc(sizeof(r_watch) * watch_count);
+            ctx->watch_count = parse_int(ctx, s, 0);
+            if (ctx->watch_count > 0)
+                ctx->watches = malloc(sizeof(r_watch) * ctx->watch_count);
             watches_allocated = 1;
         }
         else
@@ -1093,11 +3570,11 @@ int main(int argc, char** argv)
             char *p = s;
             r_watch watch;
             memset(&watch, 0, sizeof(watch));
-            watch.index = parse_int(p, 0);
+            watch.index = parse_int(ctx, p, 0);
             while (*(p++) != ',');
-            watch.pc = parse_int(p + 2, 16);
+            watch.pc = parse_int(ctx, p + 2, 16);
             while (*(p++) != ',');
-            watch.post = parse_int(p, 0);
+            watch.post = parse_int(ctx, p, 0);
             while (*(p++) != ',');
             if (strncmp(p, "u8", 2) == 0)
                 watch.data_type = u8;
@@ -1110,14 +3587,14 @@ int main(int argc, char** argv)
             else
             {
                 fprintf(stderr, "Invalid data type!");
-                exit(1);
+                stop_run(ctx);
             }
             while (*(p++) != ',');
             if (strncmp(p, "mem", 3) == 0)
             {
                 watch.type = MEMORY;
                 while (*(p++) != ',');
-                watch.memory_address = parse_int(p + 2, 16);
+                watch.memory_address = parse_int(ctx, p + 2, 16);
             }
             else
             {
@@ -1131,105 +3608,919 @@ int main(int argc, char** argv)
             }
             int32_t offset = (((int32_t)watch.pc) << 1) | watch.post;
 
-            if (watch_offset_for_pc_and_post[offset] == -1)
-                watch_offset_for_pc_and_post[offset] = watch_index;
-
-            watches[watch_index++] = watch;
+            if (ctx->watch_offset_for_pc_and_post[offset] == -1)
+                ctx->watch_offset_for_pc_and_post[offset] = watch_index;
 
-//             printf("watch index %d pc 0x%04x post %d data_type %d type %d memory_address 0x%04x offset %d value %d\n",
-//                    watch.index, watch.pc, watch.post, watch.data_type, watch.type,
-//                    watch.memory_address, offset, watch_offset_for_pc_and_post[offset]
-//             );
+            ctx->watches[watch_index++] = watch;
         }
     }
+}
+
+r_context* create_context()
+{
+    r_context* ctx = calloc(1, sizeof(r_context));
+    if (!ctx)
+    {
+        fprintf(stderr, "Error allocating emulator context.\n");
+        exit(1);
+    }
+    ctx->show_log = 1;
+    ctx->show_screen = 1;
+    ctx->use_block_cache = 1;
+    ctx->start_pc = 0x6000;
+    ctx->start_frame_pc = 0xffff;
+    ctx->log_ring_size = 20;
+    ctx->frames_delay = 10; // pgif's default
+    ctx->recorded_delay = 10;
+    ctx->out = stdout;
+    ctx->trace_stack_pointer = 0xff;
+    for (int i = 0; i < 0x20000; i++)
+        ctx->watch_offset_for_pc_and_post[i] = -1;
+    return ctx;
+}
+
+void free_context(r_context* ctx)
+{
+    if (ctx->out && ctx->out != stdout)
+        fclose(ctx->out);
+    flush_pending_screen(ctx);
+    if (ctx->frames)
+        fclose(ctx->frames);
+    if (ctx->gif)
+        finish_gif_encoder(ctx);
+    if (ctx->gif_file)
+        fclose(ctx->gif_file);
+    if (ctx->watches)
+        free(ctx->watches);
+    if (ctx->log_ring)
+        free(ctx->log_ring);
+    if (ctx->block_pool)
+        free(ctx->block_pool);
+    if (ctx->call_edges)
+        free(ctx->call_edges);
+    if (ctx->frame_durations)
+        free(ctx->frame_durations);
+    if (ctx->write_log)
+        free(ctx->write_log);
+    if (ctx->heat_map)
+        free(ctx->heat_map);
+    if (ctx->pc_cycles)
+        free(ctx->pc_cycles);
+    if (ctx->keys)
+        free(ctx->keys);
+    if (ctx->reference)
+        free_context(ctx->reference);
+#ifdef JIT
+    if (ctx->jit_buffer)
+        munmap(ctx->jit_buffer, JIT_BUFFER_SIZE);
+#endif
+    free(ctx);
+}
 
-    for (int i = 1; i < argc - 1; i++)
+/*
+ * Parses the options of a run, the last argument is the memory dump.
+ * --output and --watches are meant for batch jobs, which can't share
+ * stdin and stdout. Returns 0 on errors.
+ */
+int parse_arguments(r_context* ctx, int argc, char** argv, const char** path, const char** watches_path)
+{
+    for (int i = 0; i < argc - 1; i++)
     {
         if (strcmp(argv[i], "--hide-log") == 0)
-            show_log = 0;
+            ctx->show_log = 0;
+        else if (strcmp(argv[i], "--log-size") == 0 && i + 1 < argc - 1)
+        {
+            ctx->log_ring_size = strtol(argv[++i], 0, 0);
+            if (ctx->log_ring_size == 0)
+                ctx->show_log = 0;
+        }
         else if (strcmp(argv[i], "--no-screen") == 0)
-            show_screen = 0;
-        else if (strcmp(argv[i], "--start-pc") == 0)
+            ctx->show_screen = 0;
+        else if (strcmp(argv[i], "--text-events") == 0)
+            ctx->text_events = 1;
+        else if (strcmp(argv[i], "--no-block-cache") == 0)
+            ctx->use_block_cache = 0;
+#ifdef JIT
+        else if (strcmp(argv[i], "--jit") == 0)
+            ctx->use_jit = 1;
+        else if (strcmp(argv[i], "--jit-verify") == 0)
+        {
+            ctx->use_jit = 1;
+            ctx->jit_verify = 1;
+        }
+#endif
+        else if (strcmp(argv[i], "--start-pc") == 0 && i + 1 < argc - 1)
+        {
+            ctx->start_pc = strtol(argv[++i], 0, 0);
+            fprintf(stderr, "Using start PC: 0x%04x\n", ctx->start_pc);
+        }
+        else if (strcmp(argv[i], "--start-frame") == 0 && i + 1 < argc - 1)
+        {
+            ctx->start_frame_pc = strtol(argv[++i], 0, 0);
+            fprintf(stderr, "Using frame start: 0x%04x\n", ctx->start_frame_pc);
+        }
+        else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc - 1)
+        {
+            const char* output_path = argv[++i];
+            if (ctx->out != stdout)
+                fclose(ctx->out);
+            ctx->out = fopen(output_path, "wb");
+            if (!ctx->out)
+            {
+                ctx->out = stdout;
+                fprintf(stderr, "Error opening output file: %s\n", output_path);
+                return 0;
+            }
+        }
+        else if (strcmp(argv[i], "--watches") == 0 && i + 1 < argc - 1)
+            *watches_path = argv[++i];
+        else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc - 1)
+        {
+            const char* frames_path = argv[++i];
+            if (ctx->frames)
+                fclose(ctx->frames);
+            ctx->frames = fopen(frames_path, "wb");
+            if (!ctx->frames)
+            {
+                fprintf(stderr, "Error opening frames file: %s\n", frames_path);
+                return 0;
+            }
+        }
+        else if (strcmp(argv[i], "--gif") == 0 && i + 1 < argc - 1)
+        {
+            const char* gif_path = argv[++i];
+            if (ctx->gif_file)
+                fclose(ctx->gif_file);
+            ctx->gif_file = fopen(gif_path, "wb");
+            if (!ctx->gif_file)
+            {
+                fprintf(stderr, "Error opening GIF file: %s\n", gif_path);
+                return 0;
+            }
+        }
+        else if (strcmp(argv[i], "--max-frames") == 0 && i + 1 < argc - 1)
+            ctx->max_frames = strtoull(argv[++i], 0, 0);
+        else if (strcmp(argv[i], "--max-cycles") == 0 && i + 1 < argc - 1)
+            ctx->max_cycles = strtoull(argv[++i], 0, 0);
+        else if (strcmp(argv[i], "--max-instructions") == 0 && i + 1 < argc - 1)
+            ctx->max_instructions = strtoull(argv[++i], 0, 0);
+        else if (strcmp(argv[i], "--lockstep") == 0)
+            ctx->lockstep = 1;
+        else if (strcmp(argv[i], "--write-watch") == 0 && i + 2 < argc - 1)
+        {
+            uint32_t first = strtol(argv[++i], 0, 0) & 0xffff;
+            uint32_t last = strtol(argv[++i], 0, 0) & 0xffff;
+            for (uint32_t address = first; address <= last; address++)
+            {
+                ctx->write_watched[address >> 3] |= 1 << (address & 7);
+                ctx->write_page_flags[address >> 8] |= WRITE_FLAG_WATCH;
+            }
+            ctx->has_write_watches = 1;
+        }
+        else if (strcmp(argv[i], "--heat-map") == 0)
+            ctx->record_heat_map = 1;
+        else if (strcmp(argv[i], "--page-crossings") == 0)
+            ctx->record_page_crossings = 1;
+        else if (strcmp(argv[i], "--soft-switches") == 0)
+            ctx->soft_switches = 1;
+        else if (strcmp(argv[i], "--keys") == 0 && i + 1 < argc - 1)
+        {
+            free(ctx->keys);
+            ctx->keys = strdup(argv[++i]);
+            ctx->key_count = strlen(ctx->keys);
+        }
+        else if (strcmp(argv[i], "--io-value") == 0 && i + 2 < argc - 1)
         {
-            char *temp = argv[++i];
-            char *p = 0;
-            start_pc = strtol(temp, &p, 0);
-            fprintf(stderr, "Using start PC: 0x%04x\n", start_pc);
+            uint16_t address = strtol(argv[++i], 0, 0);
+            uint8_t value = strtol(argv[++i], 0, 0);
+            // zero page pointers and the stack are read without handlers
+            if (address < 0x200)
+            {
+                fprintf(stderr, "--io-value can't be used for zero page or stack: 0x%04x\n", address);
+                return 0;
+            }
+            if (ctx->io_value_count == MAX_IO_VALUES)
+            {
+                fprintf(stderr, "Too many I/O values, the maximum is %d.\n", MAX_IO_VALUES);
+                return 0;
+            }
+            ctx->io_values[ctx->io_value_count].address = address;
+            ctx->io_values[ctx->io_value_count].value = value;
+            ctx->io_value_count++;
         }
-        else if (strcmp(argv[i], "--start-frame") == 0)
+        else if (strcmp(argv[i], "--bench") == 0)
         {
-            char *temp = argv[++i];
-            char *p = 0;
-            start_frame_pc = strtol(temp, &p, 0);
-            fprintf(stderr, "Using frame start: 0x%04x\n", start_frame_pc);
+            ctx->bench = 1;
+            ctx->show_log = 0;
+            ctx->show_screen = 0;
         }
+        else if (strcmp(argv[i], "--call-events") == 0 && i + 1 < argc - 1)
+            ctx->call_events_for_function[strtol(argv[++i], 0, 0) & 0xffff] = 1;
         else
         {
             fprintf(stderr, "Unknown argument: %s\n", argv[i]);
+            return 0;
+        }
+    }
+    if (argc < 1)
+    {
+        fprintf(stderr, "No memory dump given.\n");
+        return 0;
+    }
+    if (ctx->record_heat_map)
+    {
+        if (ctx->lockstep)
+        {
+            fprintf(stderr, "--heat-map can't be combined with --lockstep.\n");
+            return 0;
+        }
+        // cached blocks don't fetch their instructions again
+        ctx->use_block_cache = 0;
+    }
+    if (ctx->record_page_crossings)
+    {
+        if (ctx->lockstep)
+        {
+            fprintf(stderr, "--page-crossings can't be combined with --lockstep.\n");
+            return 0;
+        }
+        // blocks only count their cycles as a whole
+        ctx->use_block_cache = 0;
+    }
+    if (ctx->bench)
+    {
+        if (ctx->frames || ctx->gif_file)
+        {
+            fprintf(stderr, "--bench can't be combined with --frames or --gif.\n");
+            return 0;
+        }
+        // events are still generated, but not written anywhere
+        if (ctx->out != stdout)
+            fclose(ctx->out);
+        ctx->out = fopen("/dev/null", "wb");
+        if (!ctx->out)
+        {
+            ctx->out = stdout;
+            fprintf(stderr, "Error opening /dev/null\n");
+            return 0;
+        }
+    }
+    *path = argv[argc - 1];
+    return 1;
+}
+
+void print_lockstep_state(const char* engine, r_context* ctx)
+{
+    fprintf(stderr, "%-10s %04x  %02x %02x %02x %02x %02x    %-12" PRIu64 " %" PRIu64 "%s\n",
+            engine, ctx->cpu.pc, ctx->cpu.sp, ctx->cpu.a, ctx->cpu.x, ctx->cpu.y, get_flags(ctx),
+            ctx->cpu.total_cycles, ctx->instruction_count, ctx->brk_encountered ? " (BRK)" : "");
+    fprintf(stderr, "%-10s", "");
+    for (uint32_t i = 0; i < ctx->write_log_count && i < 16; i++)
+        fprintf(stderr, " %04x=%02x", ctx->write_log[i].address, ctx->write_log[i].value);
+    if (ctx->write_log_count > 16)
+        fprintf(stderr, " (%u writes)", ctx->write_log_count);
+    fprintf(stderr, "%s\n", ctx->write_log_count ? "" : " no writes");
+}
+
+// prints both states and the memory writes since the last match, then stops
+void report_lockstep_mismatch(r_context* ctx, uint16_t step_pc)
+{
+    r_context* reference = ctx->reference;
+    fprintf(stderr, "Lockstep mismatch after the step at 0x%04x:\n", step_pc);
+    fprintf(stderr, "           PC    SP A  X  Y  flags cycles       instructions\n");
+    print_lockstep_state("Engine:", ctx);
+    print_lockstep_state("Reference:", reference);
+    int differences = 0;
+    for (int i = 0; i < 0x10000; i++)
+        if (ctx->ram[i] != reference->ram[i] && differences++ < 16)
+            fprintf(stderr, "ram[0x%04x]: engine %02x, reference %02x\n", i, ctx->ram[i], reference->ram[i]);
+    emit_error(ctx, "Lockstep mismatch after the step at 0x%04x", step_pc);
+    ctx->lockstep_mismatch = 1;
+    stop_run(ctx);
+}
+
+uint8_t lockstep_states_match(r_context* ctx, r_context* reference)
+{
+    if (ctx->cpu.pc != reference->cpu.pc || ctx->cpu.sp != reference->cpu.sp ||
+        ctx->cpu.a != reference->cpu.a || ctx->cpu.x != reference->cpu.x ||
+        ctx->cpu.y != reference->cpu.y || get_flags(ctx) != get_flags(reference) ||
+        ctx->cpu.total_cycles != reference->cpu.total_cycles ||
+        ctx->instruction_count != reference->instruction_count ||
+        ctx->brk_encountered != reference->brk_encountered ||
+        ctx->write_log_count != reference->write_log_count)
+        return 0;
+    for (uint32_t i = 0; i < ctx->write_log_count; i++)
+        if (ctx->write_log[i].address != reference->write_log[i].address ||
+            ctx->write_log[i].value != reference->write_log[i].value)
+            return 0;
+    return 1;
+}
+
+/*
+ * --lockstep: runs the engine selected by the options (block cache, JIT)
+ * and the reference interpreter (no block cache) side by side on copies
+ * of the same memory. After every block, or every instruction without the
+ * block cache, the reference catches up to the same instruction count and
+ * both have to agree on the registers, the flags, the cycles and the
+ * memory writes in between. Stops at the first difference. If one of
+ * them stops with an error, the other one has to stop with an error at
+ * the same instruction. Watches, screens and the execution log are left
+ * out.
+ */
+void run_lockstep(r_context* ctx)
+{
+    r_context* reference = create_context();
+    ctx->reference = reference;
+    reference->show_log = 0;
+    reference->show_screen = 0;
+    reference->use_block_cache = 0;
+    reference->out = fopen("/dev/null", "wb");
+    if (!reference->out)
+    {
+        reference->out = stdout;
+        fprintf(stderr, "Error opening /dev/null\n");
+        stop_run(ctx);
+    }
+    memcpy(reference->ram, ctx->ram, sizeof(ctx->ram));
+    reference->cpu = ctx->cpu;
+    reference->soft_switches = ctx->soft_switches;
+    if (ctx->keys)
+        reference->keys = strdup(ctx->keys);
+    reference->key_count = ctx->key_count;
+    memcpy(reference->io_values, ctx->io_values, sizeof(ctx->io_values));
+    reference->io_value_count = ctx->io_value_count;
+    register_io_pages(reference);
+    for (int page = 0; page < 0x100; page++)
+    {
+        ctx->write_page_flags[page] |= WRITE_FLAG_LOG;
+        reference->write_page_flags[page] |= WRITE_FLAG_LOG;
+    }
+
+    volatile uint16_t step_pc = ctx->cpu.pc;
+    volatile uint8_t engine_failed = 0;
+    jmp_buf error_exit;
+    memcpy(error_exit, ctx->error_exit, sizeof(jmp_buf));
+    if (setjmp(ctx->error_exit))
+    {
+        memcpy(ctx->error_exit, error_exit, sizeof(jmp_buf));
+        if (ctx->lockstep_mismatch)
+            stop_run(ctx);
+        // the reference has to fail on the same instruction, which may be
+        // anywhere in the block, whose instructions haven't been counted
+        engine_failed = 1;
+        while (reference->instruction_count <= ctx->instruction_count + MAX_BLOCK_INSTRUCTIONS &&
+               !reference->brk_encountered)
+            handle_next_opcode(reference, RUN_IO);
+        fprintf(stderr, "The engine stopped with an error, the reference interpreter didn't.\n");
+        report_lockstep_mismatch(ctx, step_pc);
+    }
+    if (setjmp(reference->error_exit))
+    {
+        if (!engine_failed)
+        {
+            fprintf(stderr, "The reference interpreter stopped with an error, the engine didn't.\n");
+            report_lockstep_mismatch(ctx, step_pc);
+        }
+        if (reference->instruction_count >= ctx->instruction_count)
+            ctx->instruction_count = reference->instruction_count;
+        if (!lockstep_states_match(ctx, reference) || ctx->old_pc != reference->old_pc)
+            report_lockstep_mismatch(ctx, step_pc);
+        stop_run(ctx);
+    }
+    while (!ctx->brk_encountered)
+    {
+        step_pc = ctx->cpu.pc;
+        if (ctx->use_block_cache)
+            run_next_block(ctx, RUN_BLOCK_CACHE | RUN_IO);
+        else
+            handle_next_opcode(ctx, RUN_IO);
+        while (reference->instruction_count < ctx->instruction_count && !reference->brk_encountered)
+            handle_next_opcode(reference, RUN_IO);
+        if (!lockstep_states_match(ctx, reference))
+            report_lockstep_mismatch(ctx, step_pc);
+        ctx->write_log_count = 0;
+        reference->write_log_count = 0;
+        if (limit_reached(ctx))
+            break;
+        if (stop_requested)
+        {
+            ctx->interrupted = 1;
+            break;
+        }
+    }
+    memcpy(ctx->error_exit, error_exit, sizeof(jmp_buf));
+    // every write has been compared, this catches writes bypassing write8()
+    if (memcmp(ctx->ram, reference->ram, sizeof(ctx->ram)) != 0)
+        report_lockstep_mismatch(ctx, step_pc);
+}
+
+/*
+ * Loads the memory dump and runs the emulator until BRK or an error.
+ * Returns the exit status of the run.
+ */
+int run_context(r_context* ctx, const char* path, FILE* watch_file)
+{
+    if (setjmp(ctx->error_exit))
+    {
+        if (ctx->running)
+        {
+            ctx->running = 0;
+            emit_profile(ctx);
+        }
+        return 1;
+    }
+
+    if (watch_file)
+        read_watches(ctx, watch_file);
+
+    // without a path, the memory has been filled already (--fuzz)
+    if (path)
+        load(ctx, path, 0);
+    register_io_pages(ctx);
+
+    if (!ctx->text_events)
+        setvbuf(ctx->out, 0, _IOFBF, 0x10000);
+    emit_stream_header(ctx);
+    ctx->running = 1;
+
+    if (ctx->show_log)
+    {
+        ctx->log_ring = malloc(sizeof(r_log_event) * ctx->log_ring_size);
+        if (!ctx->log_ring)
+        {
+            fprintf(stderr, "Error allocating execution log.\n");
+            return 1;
+        }
+        ctx->log_dumps_handled = log_dump_requests;
+    }
+
+    if (ctx->record_heat_map)
+    {
+        ctx->heat_map = calloc(HEAT_MAP_KINDS * 0x10000, sizeof(uint64_t));
+        if (!ctx->heat_map)
+        {
+            fprintf(stderr, "Error allocating heat map.\n");
+            return 1;
+        }
+        for (int page = 0; page < 0x100; page++)
+            ctx->write_page_flags[page] |= WRITE_FLAG_HEAT_MAP;
+    }
+
+    if (ctx->record_page_crossings)
+    {
+        ctx->pc_cycles = calloc(0x10000, sizeof(r_pc_cycles));
+        if (!ctx->pc_cycles)
+        {
+            fprintf(stderr, "Error allocating page crossing profile.\n");
+            return 1;
+        }
+    }
+
+    if (ctx->use_block_cache)
+    {
+        ctx->block_pool = malloc(sizeof(r_block) * BLOCK_POOL_SIZE);
+        if (!ctx->block_pool)
+        {
+            fprintf(stderr, "Error allocating block cache.\n");
+            return 1;
+        }
+        ctx->write_page_flags[0x03] |= WRITE_FLAG_SCREEN_SWITCH;
+    }
+#ifdef JIT
+    if (!ctx->use_block_cache)
+        ctx->use_jit = 0;
+    if (ctx->use_jit)
+    {
+        ctx->jit_buffer = mmap(0, JIT_BUFFER_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ctx->jit_buffer == MAP_FAILED)
+        {
+            fprintf(stderr, "Unable to allocate executable memory, disabling JIT.\n");
+            ctx->jit_buffer = 0;
+            ctx->use_jit = 0;
+        }
+    }
+#endif
+
+    if (ctx->show_screen || ctx->frames || ctx->gif_file)
+    {
+        for (int page = 0x20; page < 0x60; page++)
+            ctx->write_page_flags[page] |= WRITE_FLAG_SCREEN;
+        // the first screen has no predecessor
+        memset(ctx->screen_stale, 0xff, sizeof(ctx->screen_stale));
+    }
+
+    if (ctx->gif_file)
+        start_gif_encoder(ctx);
+
+    init_cpu(&ctx->cpu);
+    ctx->cpu.pc = ctx->start_pc;
+    ctx->brk_encountered = 0;
+    int features = 0;
+    if (ctx->watch_count > 0)
+        features |= RUN_WATCHES;
+    if (ctx->show_log)
+        features |= RUN_LOG;
+    if (ctx->use_block_cache)
+        features |= RUN_BLOCK_CACHE;
+    if (ctx->start_frame_pc != 0xffff)
+        features |= RUN_FRAME_START;
+    if (ctx->read_handler_count > 0 || ctx->heat_map)
+        features |= RUN_IO;
+    if (ctx->heat_map || ctx->pc_cycles)
+        features |= RUN_PER_ADDRESS;
+    struct timespec start_time, end_time;
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    if (ctx->lockstep)
+        run_lockstep(ctx);
+    else
+        run_loop_variants[features](ctx);
+    clock_gettime(CLOCK_MONOTONIC, &end_time);
+    ctx->run_nanoseconds = (uint64_t)(end_time.tv_sec - start_time.tv_sec) * 1000000000 +
+                           end_time.tv_nsec - start_time.tv_nsec;
+    ctx->running = 0;
+    emit_profile(ctx);
+    return 0;
+}
+
+const char* stop_reason(r_context* ctx)
+{
+    if (ctx->brk_encountered)
+        return "brk";
+    if (ctx->interrupted)
+        return "interrupted";
+    if (ctx->max_frames && ctx->screen_count == ctx->max_frames)
+        return "max-frames";
+    if (ctx->max_cycles && ctx->cpu.total_cycles >= ctx->max_cycles)
+        return "max-cycles";
+    return "max-instructions";
+}
+
+/*
+ * Prints the throughput of a --bench run as JSON. Host time only covers
+ * the main loop, not loading the memory dump or writing the profile.
+ */
+void print_bench_report(r_context* ctx, const char* path)
+{
+    const char* engine = ctx->use_block_cache ? "block-cache" : "interpreter";
+#ifdef JIT
+    if (ctx->use_jit)
+        engine = ctx->jit_verify ? "jit-verify" : "jit";
+#endif
+    double seconds = ctx->run_nanoseconds / 1e9;
+    double instructions = ctx->instruction_count;
+    printf("{\n");
+    printf("  \"program\": \"");
+    for (const char* p = path; *p; p++)
+    {
+        if (*p == '"' || *p == '\\')
+            putchar('\\');
+        if ((uint8_t)*p >= 0x20)
+            putchar(*p);
+    }
+    printf("\",\n");
+    printf("  \"engine\": \"%s\",\n", engine);
+    printf("  \"stop\": \"%s\",\n", stop_reason(ctx));
+    printf("  \"cycles\": %" PRIu64 ",\n", ctx->cpu.total_cycles);
+    printf("  \"instructions\": %" PRIu64 ",\n", ctx->instruction_count);
+    printf("  \"frames\": %" PRIu64 ",\n", ctx->screen_count);
+    printf("  \"host_seconds\": %.6f,\n", seconds);
+    printf("  \"ns_per_instruction\": %.3f,\n", instructions > 0 ? ctx->run_nanoseconds / instructions : 0.0);
+    printf("  \"emulated_mhz\": %.3f,\n", seconds > 0 ? ctx->cpu.total_cycles / seconds / 1e6 : 0.0);
+    printf("  \"instructions_per_second\": %.0f\n", seconds > 0 ? instructions / seconds : 0.0);
+    printf("}\n");
+}
+
+/*
+ * Batch mode: every line of the job file holds the arguments of one run,
+ * like on the command line, usually with --output and --watches. Jobs are
+ * distributed over a pool of threads.
+ */
+typedef struct {
+    int argc;
+    char** argv;
+    char* line;
+    int status;
+    uint64_t total_cycles;
+} r_batch_job;
+
+r_batch_job* batch_jobs = 0;
+int batch_job_count = 0;
+int next_batch_job = 0;
+pthread_mutex_t batch_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void run_batch_job(r_batch_job* job)
+{
+    r_context* ctx = create_context();
+    const char* path = 0;
+    const char* watches_path = 0;
+    job->status = 1;
+    if (parse_arguments(ctx, job->argc, job->argv, &path, &watches_path))
+    {
+        FILE* watch_file = 0;
+        if (watches_path)
+        {
+            watch_file = fopen(watches_path, "r");
+            if (!watch_file)
+                fprintf(stderr, "Error reading watches: %s\n", watches_path);
+        }
+        if (!watches_path || watch_file)
+            job->status = run_context(ctx, path, watch_file);
+        if (watch_file)
+            fclose(watch_file);
+    }
+    job->total_cycles = ctx->cpu.total_cycles;
+    free_context(ctx);
+}
+
+void* batch_worker(void* arg)
+{
+    (void)arg;
+    while (1)
+    {
+        pthread_mutex_lock(&batch_mutex);
+        int index = next_batch_job++;
+        pthread_mutex_unlock(&batch_mutex);
+        if (index >= batch_job_count)
+            break;
+        run_batch_job(&batch_jobs[index]);
+    }
+    return 0;
+}
+
+int run_batch(const char* jobs_path, int thread_count)
+{
+    FILE* f = fopen(jobs_path, "r");
+    if (!f)
+    {
+        fprintf(stderr, "Error reading batch file: %s\n", jobs_path);
+        return 1;
+    }
+    char s[4096];
+    while (fgets(s, sizeof(s), f))
+    {
+        char* line = strdup(s);
+        char** argv = malloc(sizeof(char*) * (strlen(line) / 2 + 1));
+        int argc = 0;
+        for (char* token = strtok(line, " \t\r\n"); token; token = strtok(0, " \t\r\n"))
+            argv[argc++] = token;
+        if (argc == 0 || argv[0][0] == '#')
+        {
+            free(argv);
+            free(line);
+            continue;
+        }
+        batch_jobs = realloc(batch_jobs, sizeof(r_batch_job) * (batch_job_count + 1));
+        r_batch_job* job = &batch_jobs[batch_job_count++];
+        job->argc = argc;
+        job->argv = argv;
+        job->line = line;
+        job->status = 1;
+        job->total_cycles = 0;
+    }
+    fclose(f);
+
+    if (thread_count <= 0)
+        thread_count = sysconf(_SC_NPROCESSORS_ONLN);
+    if (thread_count > batch_job_count)
+        thread_count = batch_job_count;
+    pthread_t* threads = malloc(sizeof(pthread_t) * thread_count);
+    for (int i = 0; i < thread_count; i++)
+    {
+        if (pthread_create(&threads[i], 0, batch_worker, 0) != 0)
+        {
+            fprintf(stderr, "Error creating thread.\n");
             exit(1);
         }
     }
-    memset(ram, 0, sizeof(ram));
-    memset(cycles_per_function, 0, sizeof(cycles_per_function));
-    memset(calls_per_function, 0, sizeof(calls_per_function));
+    for (int i = 0; i < thread_count; i++)
+        pthread_join(threads[i], 0);
+    free(threads);
 
-    load(argv[argc - 1], 0);
+    int failed = 0;
+    for (int i = 0; i < batch_job_count; i++)
+    {
+        r_batch_job* job = &batch_jobs[i];
+        fprintf(stderr, "%s %s: %" PRIu64 " cycles\n", job->status ? "FAILED" : "done",
+                job->argv[job->argc - 1], job->total_cycles);
+        if (job->status)
+            failed++;
+        free(job->argv);
+        free(job->line);
+    }
+    free(batch_jobs);
+    return failed ? 1 : 0;
+}
 
-    init_cpu(&cpu);
-    cpu.pc = start_pc;
-    struct timespec tstart = {0, 0};
-    clock_gettime(CLOCK_MONOTONIC, &tstart);
-    unsigned long start_time = tstart.tv_sec * 1000000000 + tstart.tv_nsec;
-    uint32_t next_display_refresh = 0;
-    uint8_t old_screen_number = 0;
-    int last_cycles = -1;
-    brk_encountered = 0;
-    while (1) {
-        if (brk_encountered) break;
-        handle_watch(cpu.pc, 0);
-        uint16_t old_pc = cpu.pc;
-        handle_next_opcode();
-        handle_watch(old_pc, 1);
-        if ((start_frame_pc != 0xffff) && (cpu.pc == start_frame_pc))
+// xorshift64*
+uint64_t next_random(uint64_t* state)
+{
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545f4914f6cdd1dULL;
+}
+
+// instructions which can end a run early (BRK, stack overflow or underrun)
+uint8_t fuzz_opcode(r_opcode opcode)
+{
+    switch (opcode)
+    {
+        case NO_OPCODE:
+        case BRK: case JSR: case RTS: case RTI:
+        case PHA: case PHP: case PHX: case PHY:
+        case PLA: case PLP: case PLX: case PLY:
+            return 0;
+        default:
+            return 1;
+    }
+}
+
+/*
+ * Fills all memory with random bytes which are all opcodes accepted by
+ * fuzz_opcode(), so that wherever a jump or branch goes, execution
+ * continues. Operands and data get random values from the same set.
+ */
+void fill_fuzz_memory(uint8_t* ram, uint64_t seed)
+{
+    uint8_t opcodes[0x100];
+    int opcode_count = 0;
+    for (int i = 0; i < 0x100; i++)
+        if (opcode_table[i].addressing_mode != NO_ADDRESSING_MODE && fuzz_opcode(opcode_table[i].opcode))
+            opcodes[opcode_count++] = i;
+    uint64_t state = seed * 0x9e3779b97f4a7c15ULL + 1;
+    for (int i = 0; i < 0x10000; i++)
+        ram[i] = opcodes[next_random(&state) % opcode_count];
+}
+
+/*
+ * --fuzz: runs random memory images in lockstep (see run_lockstep()), one
+ * seed after another. The image of the first mismatch gets written to
+ * fuzz-<seed>.bin, so that it can be run again with --lockstep.
+ */
+int run_fuzz(int runs, uint64_t seed, uint64_t max_instructions, uint8_t use_block_cache, uint8_t use_jit)
+{
+    static uint8_t image[0x10000];
+    uint64_t instructions = 0;
+    int errors = 0;
+    for (int run = 0; run < runs; run++)
+    {
+        r_context* ctx = create_context();
+        ctx->show_log = 0;
+        ctx->show_screen = 0;
+        ctx->lockstep = 1;
+        ctx->max_instructions = max_instructions;
+        ctx->use_block_cache = use_block_cache;
+#ifdef JIT
+        ctx->use_jit = use_jit;
+#endif
+        ctx->out = fopen("/dev/null", "wb");
+        if (!ctx->out)
+        {
+            fprintf(stderr, "Error opening /dev/null\n");
+            exit(1);
+        }
+        fill_fuzz_memory(ctx->ram, seed + run);
+        memcpy(image, ctx->ram, sizeof(image));
+        int status = run_context(ctx, 0, 0);
+        uint8_t mismatch = ctx->lockstep_mismatch;
+        instructions += ctx->instruction_count;
+        free_context(ctx);
+        // stored data may be executed as an unknown opcode, which is fine
+        // as long as both stop there
+        if (status && !mismatch)
+            errors++;
+        if (mismatch)
         {
-            if (last_frame_cycle_count > 0)
+            char path[64];
+            snprintf(path, sizeof(path), "fuzz-%" PRIu64 ".bin", seed + run);
+            FILE* f = fopen(path, "wb");
+            if (f)
             {
-                frame_cycle_count += (cpu.total_cycles - last_frame_cycle_count);
-                frame_count += 1;
+                fwrite(image, sizeof(image), 1, f);
+                fclose(f);
             }
-            last_frame_cycle_count = cpu.total_cycles;
+            fprintf(stderr, "Run %d failed, to repeat it: ./p65c02 --lockstep%s --max-instructions %" PRIu64 " %s\n",
+                    run, use_block_cache ? (use_jit ? " --jit" : "") : " --no-block-cache", max_instructions, path);
+            return 1;
+        }
+    }
+    fprintf(stderr, "%d runs (%d stopped with an error), %" PRIu64 " instructions, no mismatches.\n",
+            runs, errors, instructions);
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 2)
+    {
+        printf("Usage: ./champ [options] <memory dump>\n");
+        printf("       ./champ --batch <job file> [--threads <n>]\n");
+        printf("       ./champ --fuzz <runs> [--seed <n>] [--max-instructions <n>] [--no-block-cache] [--jit]\n");
+        printf("\n");
+        printf("Options:\n");
+        printf("  --hide-log\n");
+        printf("  --log-size <n> (default: 20)\n");
+        printf("  --start-pc <address or label>\n");
+        printf("  --start-frame <address> (default: frames start at every screen)\n");
+        printf("  --max-frames <n>\n");
+        printf("  --max-cycles <n>\n");
+        printf("  --max-instructions <n>\n");
+        printf("  --bench (no output, print throughput as JSON)\n");
+        printf("  --lockstep (compare every block with the reference interpreter)\n");
+        printf("  --no-screen\n");
+        printf("  --text-events\n");
+        printf("  --no-block-cache\n");
+#ifdef JIT
+        printf("  --jit\n");
+        printf("  --jit-verify\n");
+#endif
+        printf("  --output <file> (default: stdout)\n");
+        printf("  --watches <file> (default: stdin)\n");
+        printf("  --frames <file> (write screens as pgif input)\n");
+        printf("  --gif <file> (write screens as animated GIF)\n");
+        printf("  --call-events <address> (report every call of this function)\n");
+        printf("  --write-watch <first> <last> (report every write to this address range)\n");
+        printf("  --heat-map (count reads, writes and fetches per address, no block cache)\n");
+        printf("  --page-crossings (split cycles per instruction into base cycles and penalties, no block cache)\n");
+        printf("  --soft-switches (Apple II keyboard at $C000/$C010)\n");
+        printf("  --keys <text> (typed on the keyboard, with --soft-switches)\n");
+        printf("  --io-value <address> <value> (reads of this address return value)\n");
+        exit(1);
+    }
+
+    init_opcode_table();
+    signal(SIGUSR1, request_log_dump);
+    signal(SIGINT, request_stop);
+
+    if (strcmp(argv[1], "--batch") == 0)
+    {
+        if (argc < 3)
+        {
+            printf("Usage: ./champ --batch <job file> [--threads <n>]\n");
+            exit(1);
         }
-        if (cpu.total_cycles / 100000 != last_cycles)
+        int thread_count = 0;
+        if (argc > 4 && strcmp(argv[3], "--threads") == 0)
+            thread_count = strtol(argv[4], 0, 0);
+        return run_batch(argv[2], thread_count);
+    }
+
+    if (strcmp(argv[1], "--fuzz") == 0)
+    {
+        if (argc < 3)
         {
-            last_cycles = cpu.total_cycles / 100000;
-            printf("cycles %d\n", last_cycles * 100000);
+            printf("Usage: ./champ --fuzz <runs> [--seed <n>] [--max-instructions <n>] [--no-block-cache] [--jit]\n");
+            exit(1);
         }
-        if (ram[0x30b] != old_screen_number)
+        int runs = strtol(argv[2], 0, 0);
+        uint64_t seed = 1;
+        uint64_t max_instructions = 100000;
+        uint8_t use_block_cache = 1;
+        uint8_t use_jit = 0;
+        for (int i = 3; i < argc; i++)
         {
-            old_screen_number = ram[0x30b];
-            uint8_t current_screen = old_screen_number;
-            int x, y;
-            printf("screen %d", cpu.total_cycles);
-            if (show_screen)
+            if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc)
+                seed = strtoull(argv[++i], 0, 0);
+            else if (strcmp(argv[i], "--max-instructions") == 0 && i + 1 < argc)
+                max_instructions = strtoull(argv[++i], 0, 0);
+            else if (strcmp(argv[i], "--no-block-cache") == 0)
+                use_block_cache = 0;
+#ifdef JIT
+            else if (strcmp(argv[i], "--jit") == 0)
+                use_jit = 1;
+#endif
+            else
             {
-                for (y = 0; y < 192; y++)
-                {
-                    uint16_t line_offset = yoffset[y] | (current_screen == 1 ? 0x2000 : 0x4000);
-                    for (x = 0; x < 40; x++)
-                        printf(" %d", ram[line_offset + x]);
-                }
+                fprintf(stderr, "Unknown argument: %s\n", argv[i]);
+                return 1;
             }
-            printf("\n");
-            fflush(stdout);
         }
+        return run_fuzz(runs, seed, max_instructions, use_block_cache, use_jit);
     }
-    fprintf(stderr, "Total cycles: %d\n", cpu.total_cycles);
 
-    if (watches)
+    r_context* ctx = create_context();
+    const char* path = 0;
+    const char* watches_path = 0;
+    if (!parse_arguments(ctx, argc - 1, argv + 1, &path, &watches_path))
+        exit(1);
+    FILE* watch_file = (ctx->bench || ctx->lockstep) ? 0 : stdin;
+    if (watches_path)
     {
-        free(watches);
-        watches = 0;
+        watch_file = fopen(watches_path, "r");
+        if (!watch_file)
+        {
+            fprintf(stderr, "Error reading watches: %s\n", watches_path);
+            exit(1);
+        }
     }
-
-    return 0;
+    int status = run_context(ctx, path, watch_file);
+    if (watch_file && watch_file != stdin)
+        fclose(watch_file);
+    if (status == 0)
+        fprintf(stderr, "Total cycles: %" PRIu64 "\n", ctx->cpu.total_cycles);
+    if (status == 0 && ctx->bench)
+        print_bench_report(ctx, path);
+    free_context(ctx);
+    return status;
 }
@@ -2,323 +2,345 @@
 #include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include "gif.h"
 
 #pragma pack(push, 1)
 
-#define ANIMATION_OPTIMIZATION_CROP
-// don't use transparency, it's not saving space with 1 bit graphics
-// #define ANIMATION_OPTIMIZATION_TRANSPARENCY
-
-struct header_block {
-    char signature[3];
-    char version[3];
-};
-
-struct logical_screen_descriptor {
-    uint16_t canvas_width;
-    uint16_t canvas_height;
-    uint8_t size_of_global_color_table: 3;
-    uint8_t sort_flag: 1;
-    uint8_t color_resolution: 3;
-    uint8_t global_color_table_flag: 1;
-    uint8_t background_color_index;
-    uint8_t pixel_aspect_ratio;
-};
-
-struct graphics_control_extension {
-    uint8_t extension_introducer;
-    uint8_t graphics_control_label;
-    uint8_t byte_size;
-    uint8_t transparent_color_flag: 1;
-    uint8_t user_input_flag: 1;
-    uint8_t disposal_method: 3;
-    uint8_t reserved: 3;
-    uint16_t delay_time;
-    uint8_t transparent_color_index;
-    uint8_t block_terminator;
+// binary frame command 'p', followed by length bytes of packed pixels
+struct packed_frame_header {
+    uint8_t bits_per_pixel;
+    uint32_t length;
 };
 
-struct image_descriptor {
-    uint8_t image_separator;
-    uint16_t image_left;
-    uint16_t image_top;
-    uint16_t image_width;
-    uint16_t image_height;
-    uint8_t size_of_local_color_table: 3;
-    uint8_t reserved: 2;
-    uint8_t sort_flag: 1;
-    uint8_t interlace_flag: 1;
-    uint8_t local_color_table_flag: 1;
-};
-
-struct application_extension {
-    uint8_t gif_extension_code;
-    uint8_t application_extension_label;
-    uint8_t length_of_application_block;
-    char label[11];
-    uint8_t length_of_data_sub_block;
-    uint8_t one;
-    uint16_t loop_count;
-    uint8_t terminator;
+// frame file, followed by frame_count delays (16 bit, in 1/100 seconds)
+// and frame_count packed frames
+struct frame_file_header {
+    char magic[4]; // PGIF
+    uint16_t width;
+    uint16_t height;
+    uint8_t bits_per_pixel;
+    uint32_t frame_count;
 };
 
 #pragma pack(pop)
 
-void put8(uint8_t i)
+/*
+ * Packed frames hold 1, 2, 4 or 8 bits per pixel, most significant bits
+ * first. Every line starts with a new byte.
+ */
+uint32_t packed_line_size(uint16_t width, uint8_t bits_per_pixel)
 {
-    fputc(i, stdout);
+    return ((uint32_t)width * bits_per_pixel + 7) / 8;
 }
 
-void put_struct(void* p, size_t size)
+int valid_bits_per_pixel(uint8_t bits_per_pixel)
 {
-    for (int i = 0; i < size; i++)
-        put8(*(unsigned char*)(p + i));
+    return bits_per_pixel == 1 || bits_per_pixel == 2 || bits_per_pixel == 4 || bits_per_pixel == 8;
 }
 
-struct lzw_emitter {
-    uint8_t byte_buffer[255];
-    uint8_t byte_buffer_size;
-    uint32_t buffer;
-    int8_t offset;
-    uint8_t code_size;
-};
-
-void flush_bytes(struct lzw_emitter* emitter)
+void unpack_pixels(uint8_t* pixels, const uint8_t* data, uint16_t width, uint16_t height, uint8_t bits_per_pixel)
 {
-    put8(emitter->byte_buffer_size);
-    put_struct(emitter->byte_buffer, emitter->byte_buffer_size);
-    emitter->byte_buffer_size = 0;
-}
-
-void emit_byte(struct lzw_emitter* emitter)
-{
-    emitter->byte_buffer[emitter->byte_buffer_size++] = emitter->buffer & 0xff;
-    emitter->buffer >>= 8;
-    emitter->offset -= 8;
-    if (emitter->byte_buffer_size == 0xff)
-        flush_bytes(emitter);
+    uint32_t line_size = packed_line_size(width, bits_per_pixel);
+    uint8_t mask = (1 << bits_per_pixel) - 1;
+    for (int y = 0; y < height; y++)
+    {
+        const uint8_t* line = data + y * line_size;
+        if (bits_per_pixel == 8)
+        {
+            memcpy(pixels, line, width);
+            pixels += width;
+            continue;
+        }
+        for (uint32_t x = 0; x < width; x++)
+        {
+            uint32_t bit_offset = x * bits_per_pixel;
+            *(pixels++) = (line[bit_offset >> 3] >> (8 - bits_per_pixel - (bit_offset & 7))) & mask;
+        }
+    }
 }
 
-void emit_code(struct lzw_emitter* emitter, uint32_t code)
-{
-    emitter->buffer |= code << emitter->offset;
-    emitter->offset += emitter->code_size;
-    while (emitter->offset > 7)
-        emit_byte(emitter);
-}
+/*
+ * Frames get decoded into a buffer from get_frame_buffer() and then passed
+ * on with add_frame(). Every frame only depends on itself and the previous
+ * frame, so with -j, a pool of threads encodes several frames at once into
+ * memory and the main thread writes them out in order. Each frame slot
+ * keeps its pixels until the following frame has been written, which
+ * limits the number of frames in flight to slot_count - 1.
+ *
+ * A frame may come with a dirty map (see the 'c' command), which gets
+ * filled via get_dirty_map_buffer() before add_frame().
+ */
+struct frame_slot {
+    uint8_t* pixels;
+    uint8_t* dirty_map; // dirty_rows_size bytes for the lines, then the blocks
+    uint8_t has_dirty_map;
+    uint16_t frame_delay;
+    uint8_t encoded;
+    char* gif_data;
+    size_t gif_size;
+};
 
-void flush_emitter(struct lzw_emitter* emitter)
-{
-    while (emitter->offset > 0)
-        emit_byte(emitter);
-    if (emitter->byte_buffer_size > 0)
-        flush_bytes(emitter);
-}
+struct frame_encoder {
+    uint16_t width;
+    uint16_t height;
+    uint8_t colors_used;
+    uint32_t dirty_rows_size;
+    uint32_t dirty_blocks_size;
+    uint32_t slot_count;
+    struct frame_slot* slots; // frame i lives in slot i % slot_count
+    uint64_t frames_added;
+    uint64_t frames_started;
+    uint64_t frames_written;
+    uint8_t finished;
+    int thread_count; // 0: encode on the main thread
+    pthread_t* threads;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+};
 
-void encode_image(uint8_t* pixels, uint8_t* previous_pixels,
-                  uint16_t width, uint16_t height,
-                  uint8_t colors_used, uint16_t frame_delay)
+void* encoder_thread(void* arg)
 {
-    uint8_t color_depth = 1;
-    while (colors_used > (1 << color_depth))
-        color_depth++;
-    if (color_depth < 2)
-        color_depth = 2;
-
-    uint16_t cropped_left = 0;
-    uint16_t cropped_top = 0;
-    uint16_t cropped_width = width;
-    uint16_t cropped_height = height;
-    int16_t transparent_color = -1;
-
-    if (previous_pixels)
+    struct frame_encoder* encoder = arg;
+    pthread_mutex_lock(&encoder->mutex);
+    while (1)
     {
-        // if previous_pixels is not null, we can do some differential encoding!
-
-        #ifdef ANIMATION_OPTIMIZATION_CROP
-        // crop left and right
-        for (int dir = 0; dir < 2; dir++)
+        while (encoder->frames_started == encoder->frames_added && !encoder->finished)
+            pthread_cond_wait(&encoder->cond, &encoder->mutex);
+        if (encoder->frames_started == encoder->frames_added)
+            break;
+        uint64_t frame = encoder->frames_started++;
+        pthread_mutex_unlock(&encoder->mutex);
+
+        struct frame_slot* slot = &encoder->slots[frame % encoder->slot_count];
+        uint8_t* previous_pixels = 0;
+        if (frame > 0)
+            previous_pixels = encoder->slots[(frame - 1) % encoder->slot_count].pixels;
+        struct gif_dirty_map dirty = {7, slot->dirty_map, slot->dirty_map + encoder->dirty_rows_size};
+        FILE* out = open_memstream(&slot->gif_data, &slot->gif_size);
+        if (!out)
         {
-            while (cropped_width > 0)
-            {
-                uint8_t same_pixels = 1;
-                int x, y;
-                x = (dir == 0) ? cropped_left : cropped_left + cropped_width - 1;
-                for (int y = cropped_top; same_pixels && (y < cropped_top + cropped_height); y++)
-                {
-                    int offset = y * width + x;
-                    if (pixels[offset] != previous_pixels[offset])
-                        same_pixels = 0;
-                }
-                if (same_pixels)
-                {
-                    if (dir == 0)
-                        cropped_left++;
-                    cropped_width--;
-                }
-                else
-                    break;
-            }
+            fprintf(stderr, "Error allocating buffer for image.\n");
+            exit(1);
         }
+        encode_image(out, slot->pixels, previous_pixels, encoder->width, encoder->height,
+                     encoder->colors_used, slot->frame_delay, slot->has_dirty_map ? &dirty : 0);
+        fclose(out);
+        slot->has_dirty_map = 0;
+
+        pthread_mutex_lock(&encoder->mutex);
+        slot->encoded = 1;
+        pthread_cond_broadcast(&encoder->cond);
+    }
+    pthread_mutex_unlock(&encoder->mutex);
+    return 0;
+}
 
-        // crop top and bottom
-        for (int dir = 0; dir < 2; dir++)
+void init_frame_encoder(struct frame_encoder* encoder, uint16_t width, uint16_t height,
+                        uint8_t colors_used, int thread_count)
+{
+    memset(encoder, 0, sizeof(*encoder));
+    encoder->width = width;
+    encoder->height = height;
+    encoder->colors_used = colors_used;
+    encoder->dirty_rows_size = (height + 7) / 8;
+    encoder->dirty_blocks_size = ((width + 6) / 7 * height + 7) / 8;
+    encoder->thread_count = thread_count > 1 ? thread_count : 0;
+    encoder->slot_count = encoder->thread_count ? encoder->thread_count * 2 + 2 : 2;
+    encoder->slots = calloc(encoder->slot_count, sizeof(struct frame_slot));
+    if (!encoder->slots)
+    {
+        fprintf(stderr, "Error allocating buffer for image.\n");
+        exit(1);
+    }
+    for (uint32_t i = 0; i < encoder->slot_count; i++)
+    {
+        encoder->slots[i].pixels = malloc(width * height);
+        encoder->slots[i].dirty_map = malloc(encoder->dirty_rows_size + encoder->dirty_blocks_size);
+        if (!encoder->slots[i].pixels || !encoder->slots[i].dirty_map)
         {
-            while (cropped_height > 0)
-            {
-                uint8_t same_pixels = 1;
-                int x, y;
-                y = (dir == 0) ? cropped_top : cropped_top + cropped_height - 1;
-                for (int x = cropped_left; same_pixels && (x < cropped_left + cropped_width); x++)
-                {
-                    int offset = y * width + x;
-                    if (pixels[offset] != previous_pixels[offset])
-                        same_pixels = 0;
-                }
-                if (same_pixels)
-                {
-                    if (dir == 0)
-                        cropped_top++;
-                    cropped_height--;
-                }
-                else
-                    break;
-            }
+            fprintf(stderr, "Error allocating buffer for image.\n");
+            exit(1);
         }
-        #endif
-
-        #ifdef ANIMATION_OPTIMIZATION_TRANSPARENCY
-        // replace unchanged pixels with tranparency
-        if (colors_used < 255)
+    }
+    pthread_mutex_init(&encoder->mutex, 0);
+    pthread_cond_init(&encoder->cond, 0);
+    if (encoder->thread_count)
+    {
+        encoder->threads = malloc(sizeof(pthread_t) * encoder->thread_count);
+        for (int i = 0; i < encoder->thread_count; i++)
         {
-            transparent_color = colors_used;
-            colors_used++;
-            while (colors_used >= (1 << color_depth))
-                color_depth++;
-            for (int y = 0; y < cropped_height; y++)
+            if (pthread_create(&encoder->threads[i], 0, encoder_thread, encoder) != 0)
             {
-                uint32_t offset = (y + cropped_top) * width + cropped_left;
-                uint8_t* p = pixels + offset;
-                uint8_t* pp = previous_pixels + offset;
-                for (int x = 0; x < cropped_width; x++)
-                {
-                    if (*p == *pp)
-                    {
-                        *p = (uint8_t)transparent_color;
-                    }
-                    p++;
-                    pp++;
-                }
+                fprintf(stderr, "Error creating thread.\n");
+                exit(1);
             }
         }
-        #endif
     }
-    // write graphics control extension
-    struct graphics_control_extension gce;
-    memset(&gce, 0, sizeof(gce));
-    gce.extension_introducer = 0x21;
-    gce.graphics_control_label = 0xf9;
-    gce.byte_size = 4;
-    gce.disposal_method = 1; // draw on top
-    gce.delay_time = frame_delay; // in 1/100 seconds
+}
 
-    #ifdef ANIMATION_OPTIMIZATION_TRANSPARENCY
-    if (transparent_color >= 0)
+// writes all frames which are ready, in order, must hold the mutex
+void write_encoded_frames(struct frame_encoder* encoder)
+{
+    while (encoder->frames_written < encoder->frames_started)
     {
-        gce.transparent_color_flag = 1;
-        gce.transparent_color_index = transparent_color;
+        struct frame_slot* slot = &encoder->slots[encoder->frames_written % encoder->slot_count];
+        if (!slot->encoded)
+            break;
+        pthread_mutex_unlock(&encoder->mutex);
+        fwrite(slot->gif_data, slot->gif_size, 1, stdout);
+        free(slot->gif_data);
+        pthread_mutex_lock(&encoder->mutex);
+        slot->gif_data = 0;
+        slot->encoded = 0;
+        encoder->frames_written++;
     }
-    #endif
-    put_struct(&gce, sizeof(gce));
-
-    // write image descriptor
-    struct image_descriptor id;
-    memset(&id, 0, sizeof(id));
-    id.image_separator = 0x2c;
-    id.image_left = cropped_left;
-    id.image_top = cropped_top;
-    id.image_width = cropped_width;
-    id.image_height = cropped_height;
-    put_struct(&id, sizeof(id));
-
-    uint8_t lzw_minimum_code_size = color_depth;
-//     if (lzw_minimum_code_size < 2)
-//         lzw_minimum_code_size = 2;
-
-    put8(lzw_minimum_code_size);
-
-    struct lzw_emitter emitter;
-    emitter.byte_buffer_size = 0;
-    emitter.buffer = 0;
-    emitter.offset = 0;
-    emitter.code_size = lzw_minimum_code_size + 1;
+}
 
-    // set up LZW encoder
-    uint16_t clear_code = (1 << color_depth);
-    uint16_t end_of_information_code = clear_code + 1;
+// returns the buffer for the next frame, once its slot is free
+uint8_t* get_frame_buffer(struct frame_encoder* encoder)
+{
+    if (!encoder->thread_count)
+        return encoder->slots[encoder->frames_added % encoder->slot_count].pixels;
+    pthread_mutex_lock(&encoder->mutex);
+    while (encoder->frames_added + 2 > encoder->frames_written + encoder->slot_count)
+    {
+        write_encoded_frames(encoder);
+        if (encoder->frames_added + 2 > encoder->frames_written + encoder->slot_count)
+            pthread_cond_wait(&encoder->cond, &encoder->mutex);
+    }
+    pthread_mutex_unlock(&encoder->mutex);
+    return encoder->slots[encoder->frames_added % encoder->slot_count].pixels;
+}
 
-    uint16_t* prefix_table = malloc(sizeof(uint16_t) * (2048 - 1 - end_of_information_code));
-    uint8_t* suffix_table = malloc(sizeof(uint8_t) * (2048 - 1 - end_of_information_code));
-    uint16_t table_length = 0;
+// returns the buffer for the dirty map of the next frame
+uint8_t* get_dirty_map_buffer(struct frame_encoder* encoder)
+{
+    get_frame_buffer(encoder);
+    struct frame_slot* slot = &encoder->slots[encoder->frames_added % encoder->slot_count];
+    slot->has_dirty_map = 1;
+    return slot->dirty_map;
+}
 
-    emit_code(&emitter, clear_code);
+void add_frame(struct frame_encoder* encoder, uint16_t frame_delay)
+{
+    if (!encoder->thread_count)
+    {
+        struct frame_slot* slot = &encoder->slots[encoder->frames_added % 2];
+        uint8_t* previous_pixels = 0;
+        if (encoder->frames_added > 0)
+            previous_pixels = encoder->slots[(encoder->frames_added - 1) % 2].pixels;
+        struct gif_dirty_map dirty = {7, slot->dirty_map, slot->dirty_map + encoder->dirty_rows_size};
+        encode_image(stdout, slot->pixels, previous_pixels, encoder->width, encoder->height,
+                     encoder->colors_used, frame_delay, slot->has_dirty_map ? &dirty : 0);
+        slot->has_dirty_map = 0;
+        encoder->frames_added++;
+        return;
+    }
+    pthread_mutex_lock(&encoder->mutex);
+    encoder->slots[encoder->frames_added % encoder->slot_count].frame_delay = frame_delay;
+    encoder->frames_added++;
+    pthread_cond_broadcast(&encoder->cond);
+    write_encoded_frames(encoder);
+    pthread_mutex_unlock(&encoder->mutex);
+}
 
-    uint8_t* p = pixels;
-    uint16_t index_buffer = 0;
-    for (int y = 0; y < cropped_height; y++)
+// writes all remaining frames and stops the threads
+void finish_frame_encoder(struct frame_encoder* encoder)
+{
+    if (encoder->thread_count)
     {
-        uint8_t* p = pixels + (y + cropped_top) * width + cropped_left;
-        for (int x = 0; x < cropped_width; x++)
+        pthread_mutex_lock(&encoder->mutex);
+        encoder->finished = 1;
+        pthread_cond_broadcast(&encoder->cond);
+        while (encoder->frames_written < encoder->frames_added)
         {
-            if (x == 0 && y == 0)
-            {
-                index_buffer = (uint16_t)(*(p++));
-                continue;
-            }
-            uint8_t k = *(p++);
-            uint16_t found_table_entry = 0xffff;
-            for (int i = 0; i < table_length; i++)
-                if (index_buffer == prefix_table[i] && k == suffix_table[i])
-                    found_table_entry = i + end_of_information_code + 1;
-            if (found_table_entry < 0xffff)
-                index_buffer = found_table_entry;
-            else
-            {
-                prefix_table[table_length] = index_buffer;
-                suffix_table[table_length] = k;
-                table_length += 1;
-                if (table_length + end_of_information_code > (1 << emitter.code_size))
-                    emitter.code_size++;
-                emit_code(&emitter, index_buffer);
-                index_buffer = k;
-                if (table_length >= 2048 - 1 - end_of_information_code)
-                {
-                    emit_code(&emitter, clear_code);
-                    table_length = 0;
-                    emitter.code_size = lzw_minimum_code_size + 1;
-                }
-            }
+            write_encoded_frames(encoder);
+            if (encoder->frames_written < encoder->frames_added)
+                pthread_cond_wait(&encoder->cond, &encoder->mutex);
         }
+        pthread_mutex_unlock(&encoder->mutex);
+        for (int i = 0; i < encoder->thread_count; i++)
+            pthread_join(encoder->threads[i], 0);
+        free(encoder->threads);
     }
+    for (uint32_t i = 0; i < encoder->slot_count; i++)
+    {
+        free(encoder->slots[i].pixels);
+        free(encoder->slots[i].dirty_map);
+    }
+    free(encoder->slots);
+    pthread_mutex_destroy(&encoder->mutex);
+    pthread_cond_destroy(&encoder->cond);
+}
 
-    emit_code(&emitter, index_buffer);
-    emit_code(&emitter, end_of_information_code);
-    flush_emitter(&emitter);
-
-    free(suffix_table);
-    free(prefix_table);
-
-    put8(0);
+// encodes all frames of a frame file, which gets mapped into memory
+void encode_frame_file(const char* path, struct frame_encoder* encoder)
+{
+    uint16_t width = encoder->width;
+    uint16_t height = encoder->height;
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0)
+    {
+        fprintf(stderr, "Error opening frame file: %s\n", path);
+        exit(1);
+    }
+    if (st.st_size < (off_t)sizeof(struct frame_file_header))
+    {
+        fprintf(stderr, "Invalid frame file: %s\n", path);
+        exit(1);
+    }
+    uint8_t* data = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED)
+    {
+        fprintf(stderr, "Error mapping frame file: %s\n", path);
+        exit(1);
+    }
+    struct frame_file_header header;
+    memcpy(&header, data, sizeof(header));
+    uint64_t frame_size = (uint64_t)packed_line_size(width, header.bits_per_pixel) * height;
+    if (memcmp(header.magic, "PGIF", 4) != 0 || header.width != width || header.height != height ||
+        !valid_bits_per_pixel(header.bits_per_pixel) ||
+        sizeof(header) + (uint64_t)header.frame_count * (sizeof(uint16_t) + frame_size) > (uint64_t)st.st_size)
+    {
+        fprintf(stderr, "Invalid frame file: %s\n", path);
+        exit(1);
+    }
+    const uint8_t* delays = data + sizeof(header);
+    const uint8_t* frame = delays + header.frame_count * sizeof(uint16_t);
+    for (uint32_t i = 0; i < header.frame_count; i++)
+    {
+        uint16_t frame_delay;
+        memcpy(&frame_delay, delays + i * sizeof(uint16_t), sizeof(uint16_t));
+        unpack_pixels(get_frame_buffer(encoder), frame, width, height, header.bits_per_pixel);
+        add_frame(encoder, frame_delay);
+        frame += frame_size;
+    }
+    munmap(data, st.st_size);
+    close(fd);
 }
 
 int main(int argc, char** argv)
 {
+    int thread_count = 0;
+    if (argc > 2 && strcmp(argv[1], "-j") == 0)
+    {
+        thread_count = strtol(argv[2], 0, 0);
+        argc -= 2;
+        argv += 2;
+    }
     if (argc < 4)
     {
         fprintf(stderr, "This program creates an animated GIF from a series of frames\n");
         fprintf(stderr, "passed via stdin.\n");
         fprintf(stderr, "\n");
-        fprintf(stderr, "Usage: ./pgif <width> <height> <number of colors>\n");
+        fprintf(stderr, "Usage: ./pgif [-j <threads>] <width> <height> <number of colors> [<frame file>]\n");
+        fprintf(stderr, "  <threads>          number of threads encoding frames in parallel\n");
         fprintf(stderr, "  <width>            1 to 65535\n");
         fprintf(stderr, "  <height>           1 to 65535\n");
         fprintf(stderr, "  <number of colors> 1 to 255\n");
@@ -329,6 +351,23 @@ int main(int argc, char** argv)
         fprintf(stderr, "- as many frames as you wish, one per line, formatted as\n");
         fprintf(stderr, "  one big hex string and starting with f\n");
         fprintf(stderr, "  example: 'f 000100000100\\n' if you specified a 3x2 image\n");
+        fprintf(stderr, "- or raw Apple II hi-res frames: 'h\\n' followed by (width + 6) / 7\n");
+        fprintf(stderr, "  bytes per line, bits 0 to 6 of every byte are 7 pixels, lowest\n");
+        fprintf(stderr, "  bit first (colors 0 and 1)\n");
+        fprintf(stderr, "- or binary frames: 'p\\n' followed by the number of bits per pixel\n");
+        fprintf(stderr, "  (1, 2, 4 or 8, one byte) and the length of the pixel data (32 bit\n");
+        fprintf(stderr, "  little endian), then the pixels, most significant bits first and\n");
+        fprintf(stderr, "  every line starting with a new byte\n");
+        fprintf(stderr, "- optionally before a frame, which parts of it may have changed:\n");
+        fprintf(stderr, "  'c\\n' followed by one bit per line ((height + 7) / 8 bytes), then\n");
+        fprintf(stderr, "  one bit per 7 pixels, line by line (((width + 6) / 7 * height + 7) / 8\n");
+        fprintf(stderr, "  bytes), lowest bit first, all other pixels must be unchanged\n");
+        fprintf(stderr, "\n");
+        fprintf(stderr, "With a frame file, only the palette is read from stdin. The file\n");
+        fprintf(stderr, "starts with 'PGIF', width and height (16 bit), bits per pixel (8 bit)\n");
+        fprintf(stderr, "and the number of frames (32 bit), followed by the delay of every\n");
+        fprintf(stderr, "frame (16 bit) and all frames, packed like above. All numbers are\n");
+        fprintf(stderr, "little endian.\n");
         fprintf(stderr, "\n");
         fprintf(stderr, "The default frame delay is 100 ms. You may change the frame delay\n");
         fprintf(stderr, "for all following frames by specifying 'd <number>\\n' where\n");
@@ -342,28 +381,6 @@ int main(int argc, char** argv)
     uint16_t height = strtol(argv[2], &temp, 0);
     uint16_t colors_used = strtol(argv[3], &temp, 0);
 
-    uint8_t color_depth = 1;
-    while (colors_used > (1 << color_depth))
-        color_depth++;
-    if (color_depth < 2)
-        color_depth = 2;
-    
-    // write header
-    struct header_block header;
-    strncpy(header.signature, "GIF", 3);
-    strncpy(header.version, "89a", 3);
-    put_struct(&header, sizeof(header));
-
-    // write logical screen descriptor
-    struct logical_screen_descriptor lsd;
-    memset(&lsd, 0, sizeof(lsd));
-    lsd.canvas_width = width;
-    lsd.canvas_height = height;
-    lsd.size_of_global_color_table = color_depth - 1;
-    lsd.color_resolution = color_depth - 1;
-    lsd.global_color_table_flag = 1;
-    put_struct(&lsd, sizeof(lsd));
-
     size_t max_line_size = width + 1024;
     char* line = malloc(max_line_size);
     if (!line)
@@ -375,7 +392,13 @@ int main(int argc, char** argv)
     char hex[4];
     memset(hex, 0, 4);
 
-    // write global color table, transfer palette from stdin to GIF
+    // transfer palette from stdin to GIF
+    uint8_t* palette = malloc(colors_used * 3);
+    if (!palette)
+    {
+        fprintf(stderr, "Error allocating palette!\n");
+        exit(1);
+    }
     for (int i = 0; i < colors_used; i++)
     {
         fgets(line, max_line_size, stdin);
@@ -383,43 +406,42 @@ int main(int argc, char** argv)
         for (int k = 0; k < 3; k++)
         {
             strncpy(hex, line_p, 2);
-            put8(strtol(hex, &temp, 16));
+            palette[i * 3 + k] = strtol(hex, &temp, 16);
             line_p += 2;
         }
     }
+    write_gif_header(stdout, width, height, colors_used, palette);
+    free(palette);
+
+    struct frame_encoder encoder;
+    init_frame_encoder(&encoder, width, height, colors_used, thread_count);
 
-    // fill remaining colors, if any
-    for (int i = colors_used; i < (1 << color_depth); i++)
+    uint16_t hires_bytes_per_line = (width + 6) / 7;
+    uint8_t* hires = malloc(hires_bytes_per_line * height);
+    if (!hires)
     {
-        put8(0); put8(0); put8(0);
+        fprintf(stderr, "Error allocating buffer for image.\n");
+        exit(1);
     }
 
-    // write application extension NETSCAPE2.0 to loop the animation
-    // (otherwise it just plays once, duh...)
-    struct application_extension ae;
-    memset(&ae, 0, sizeof(ae));
-    ae.gif_extension_code = 0x21;
-    ae.application_extension_label = 0xff;
-    ae.length_of_application_block = 0x0b;
-    strncpy(ae.label, "NETSCAPE2.0", 0x0b);
-    ae.length_of_data_sub_block = 3;
-    ae.one = 1;
-    put_struct(&ae, sizeof(ae));
+    // with a frame file, there are no more commands on stdin
+    uint8_t use_frame_file = argc > 4;
+    if (use_frame_file)
+        encode_frame_file(argv[4], &encoder);
 
-    uint8_t *previous_pixels = 0;
-
-    uint8_t* pixels = malloc(width * height);
-    if (!pixels)
+    uint8_t* packed = malloc(width * height);
+    if (!packed)
     {
         fprintf(stderr, "Error allocating buffer for image.\n");
         exit(1);
     }
 
     uint16_t frame_delay = 10;
-    while (fgets(line, max_line_size, stdin))
+    while (!use_frame_file && fgets(line, max_line_size, stdin))
     {
-        if (line[0] == 'f' || line[0] == 'l')
+        if (line[0] == 'f' || line[0] == 'l' || line[0] == 'h' || line[0] == 'p')
         {
+            uint8_t* pixels = get_frame_buffer(&encoder);
             uint8_t* p = pixels;
             if (line[0] == 'f')
             {
@@ -446,29 +468,58 @@ int main(int argc, char** argv)
                     }
                 }
             }
-            encode_image(pixels, previous_pixels, width, height, colors_used, frame_delay);
-            if (!previous_pixels)
+            else if (line[0] == 'h')
+            {
+                if (fread(hires, hires_bytes_per_line * height, 1, stdin) != 1)
+                {
+                    fprintf(stderr, "Incomplete hi-res frame.\n");
+                    break;
+                }
+                for (int y = 0; y < height; y++)
+                {
+                    uint8_t* line_hires = hires + y * hires_bytes_per_line;
+                    for (int x = 0; x < width; x++)
+                        *(p++) = (line_hires[x / 7] >> (x % 7)) & 1;
+                }
+            }
+            else if (line[0] == 'p')
             {
-                previous_pixels = malloc(width * height);
-                if (!previous_pixels)
+                struct packed_frame_header header;
+                if (fread(&header, sizeof(header), 1, stdin) != 1 ||
+                    !valid_bits_per_pixel(header.bits_per_pixel) ||
+                    header.length != packed_line_size(width, header.bits_per_pixel) * height)
                 {
-                    fprintf(stderr, "Error allocating buffer for image.\n");
-                    exit(1);
+                    fprintf(stderr, "Invalid binary frame.\n");
+                    break;
+                }
+                if (fread(packed, header.length, 1, stdin) != 1)
+                {
+                    fprintf(stderr, "Incomplete binary frame.\n");
+                    break;
                 }
+                unpack_pixels(pixels, packed, width, height, header.bits_per_pixel);
+            }
+            add_frame(&encoder, frame_delay);
+        }
+        else if (line[0] == 'c')
+        {
+            uint8_t* dirty_map = get_dirty_map_buffer(&encoder);
+            if (fread(dirty_map, encoder.dirty_rows_size + encoder.dirty_blocks_size, 1, stdin) != 1)
+            {
+                fprintf(stderr, "Incomplete dirty map.\n");
+                break;
             }
-            memcpy(previous_pixels, pixels, width * height);
         }
         else if (line[0] == 'd')
             frame_delay = strtol(line + 2, &temp, 0);
     }
 
-    if (previous_pixels)
-        free(previous_pixels);
-    free(pixels);
+    finish_frame_encoder(&encoder);
+    free(packed);
+    free(hires);
     free(line);
 
-    // write trailer
-    put8(0x3b);
+    write_gif_trailer(stdout);
 
     return 0;
 }